@@ -49,30 +49,84 @@ log2n (guint number)
 
 #define COLOR(r, g, b) (((r) << 16) | ((g) << 8) | (b))
 
+/* GIF codes are at most 12 bits */
+#define LZW_MAX_CODES (1 << 12)
+
 /*** WRITE ROUTINES ***/
 
+/* maximum size of everything but the image data: header, logical screen
+ * descriptor, loop extension, graphic control, image description and a
+ * color table */
+#define GIFENC_MAX_HEADER_SIZE (1024)
+
+/* upper bound of bytes needed to write an image of the given size */
+static gsize
+gifenc_get_image_size_bound (guint width, guint height)
+{
+  guint64 codes, bytes;
+
+  /* one code per pixel in the worst case plus clear codes, the last code
+   * and eof. Each code is at most 12 bits */
+  codes = (guint64) width * height;
+  codes += codes / 256 + 8;
+  bytes = (codes * 12 + 7) / 8;
+  /* sub-block length prefixes, terminator and room for whole word writes */
+  bytes += bytes / 255 + 8;
+
+  return GIFENC_MAX_HEADER_SIZE + bytes;
+}
+
+/* starts writing a block of at most size bytes */
+static void
+gifenc_begin (Gifenc *enc, gsize size)
+{
+  g_assert (enc->len == 0);
+
+  if (enc->arena_size < size) {
+    /* size for a full frame, so this is the only allocation */
+    g_free (enc->arena);
+    enc->arena_size = MAX (size, 
+	gifenc_get_image_size_bound (enc->width, enc->height));
+    enc->arena = g_malloc (enc->arena_size);
+  }
+  enc->data = enc->arena;
+  enc->size = size;
+}
+
 static gboolean
 gifenc_flush (Gifenc *enc, GError **error)
 {
   gboolean result;
 
-  if (enc->buffer->len == 0)
+  g_assert (enc->len <= enc->size);
+
+  if (enc->len == 0)
     return TRUE;
 
-  result = enc->write_func (enc->write_data, enc->buffer->data, 
-      enc->buffer->len, error);
+  result = enc->write_func (enc->write_data, enc->data, enc->len, error);
 
-  g_byte_array_set_size (enc->buffer, 0);
+  enc->data = NULL;
+  enc->len = 0;
+  enc->size = 0;
   return result;
 }
 
+static void
+gifenc_write (Gifenc *enc, const guint8 *data, gsize len)
+{
+  g_assert (enc->len + len <= enc->size);
+
+  memcpy (enc->data + enc->len, data, len);
+  enc->len += len;
+}
+
 static void
 gifenc_write_uint16 (Gifenc *enc, guint16 value)
 {
   g_return_if_fail (enc->n_bits == 0);
   
   value = GUINT16_TO_LE (value);
-  g_byte_array_append (enc->buffer, (guint8 *) &value, 2);
+  gifenc_write (enc, (guint8 *) &value, 2);
 }
 
 static void
@@ -80,7 +134,7 @@ gifenc_write_byte (Gifenc *enc, guint8 value)
 {
   g_return_if_fail (enc->n_bits == 0);
   
-  g_byte_array_append (enc->buffer, &value, 1);
+  gifenc_write (enc, &value, 1);
 }
 
 static void
@@ -106,7 +160,7 @@ gifenc_write_bits (Gifenc *enc, guint bits, guint nbits)
 static void
 gifenc_write_header (Gifenc *enc)
 {
-  g_byte_array_append (enc->buffer, (const guchar *) "GIF89a", 6);
+  gifenc_write (enc, (const guchar *) "GIF89a", 6);
 }
 
 static void
@@ -140,11 +194,11 @@ gifenc_write_color_table (Gifenc *enc, GifencPalette *palette)
     gifenc_write_byte (enc, BLUE (palette->colors[i]));
   }
   if (palette->alpha) {
-    g_byte_array_append (enc->buffer, (guint8 *) "\272\219\001", 3);
+    gifenc_write (enc, (guint8 *) "\272\219\001", 3);
     i++;
   }
   for (; i < table_size; i++) {
-    g_byte_array_append (enc->buffer, (guint8 *) "\0\0\0", 3);
+    gifenc_write (enc, (guint8 *) "\0\0\0", 3);
   }
 }
 
@@ -156,6 +210,8 @@ typedef struct {
   GifencPalette *palette;
   guint8 *data;
   guint rowstride;
+  guint8 *previous;	/* NULL or what is shown below transparent pixels */
+  guint previous_rowstride;
 } GifencImage;
 
 static void
@@ -175,68 +231,144 @@ gifenc_write_image_description (Gifenc *enc, const GifencImage *image)
   gifenc_write_color_table (enc, image->palette);
 }
 
+/* Codes are collected in a 64bit accumulator and written 32 bits at a time
+ * straight into the output. Image data is split into sub-blocks, the length
+ * prefix of a sub-block is only written once the block is full. Strips are
+ * compressed without sub-blocks so they can be concatenated later. */
 typedef struct {
-  guint8 data[255];
-  guint bytes;
-  guint current_data;
+  guint64 current_data;
   guint bits;
+  guint8 *data;		/* memory to write to */
+  gsize len;		/* bytes written to data */
+  gsize size;		/* bytes available in data */
+  gboolean blocks;	/* TRUE to split output into sub-blocks */
+  gsize block;		/* offset of the current sub-block in data */
+  guint bytes;		/* bytes already in the current sub-block */
 } EncodeBuffer;
 
 static void
-gifenc_buffer_write (Gifenc *enc, EncodeBuffer *buffer)
+gifenc_buffer_start_block (EncodeBuffer *buffer)
 {
-  if (buffer->bytes == 0)
-    return;
-  gifenc_write_byte (enc, buffer->bytes);
-  g_byte_array_append (enc->buffer, buffer->data, buffer->bytes);
+  buffer->block = buffer->len;
+  buffer->len++;
   buffer->bytes = 0;
 }
 
-static void G_GNUC_UNUSED
-print_bits (const char *text, guint data, int bits)
+static void
+gifenc_buffer_finish_block (EncodeBuffer *buffer)
 {
-  int i;
-  g_print ("%s %u (", text, data);
-  for (i = bits - 1; i >= 0; i--) {
-    g_print ("%c", data & (1 << i) ? '1' : '0');
+  if (buffer->bytes == 0) {
+    buffer->len = buffer->block;
+    return;
   }
-  g_print (")\n");
+  g_assert (buffer->len <= buffer->size);
+  buffer->data[buffer->block] = buffer->bytes;
 }
-#define print_bits(text, data, bits)
 
 static void
-gifenc_buffer_append (Gifenc *enc, EncodeBuffer *buffer, guint data, guint bits)
+gifenc_buffer_init (EncodeBuffer *buffer, guint8 *data, gsize len, 
+    gsize size, gboolean blocks)
 {
-  g_assert (buffer->bits + bits < 24);
+  buffer->current_data = 0;
+  buffer->bits = 0;
+  buffer->data = data;
+  buffer->len = len;
+  buffer->size = size;
+  buffer->blocks = blocks;
+  if (blocks)
+    gifenc_buffer_start_block (buffer);
+}
 
-  //g_print ("got code %u (%u)\n", data, bits);
-  print_bits ("appending", data, bits);
-  buffer->current_data |= (data << buffer->bits);
-  buffer->bits += bits;
-  while (buffer->bits >= 8) {
-    if (buffer->bytes == 255)
-      gifenc_buffer_write (enc, buffer);
-    buffer->data[buffer->bytes] = buffer->current_data;
-    print_bits ("got", buffer->data[buffer->bytes], 8);
-    buffer->bits -= 8;
+static void
+gifenc_buffer_write_bytes (EncodeBuffer *buffer, guint n_bytes)
+{
+  guint i;
+
+  for (i = 0; i < n_bytes; i++) {
+    if (buffer->blocks && buffer->bytes == 255) {
+      gifenc_buffer_finish_block (buffer);
+      gifenc_buffer_start_block (buffer);
+    }
+    buffer->data[buffer->len++] = buffer->current_data;
     buffer->current_data >>= 8;
     buffer->bytes++;
   }
 }
 
+static inline void
+gifenc_buffer_append (EncodeBuffer *buffer, guint data, guint bits)
+{
+  buffer->current_data |= (guint64) data << buffer->bits;
+  buffer->bits += bits;
+  if (buffer->bits < 32)
+    return;
+
+  if (G_LIKELY (!buffer->blocks || buffer->bytes + 4 <= 255)) {
+    guint32 word = GUINT32_TO_LE (buffer->current_data);
+    memcpy (buffer->data + buffer->len, &word, 4);
+    buffer->current_data >>= 32;
+    buffer->len += 4;
+    buffer->bytes += 4;
+  } else {
+    gifenc_buffer_write_bytes (buffer, 4);
+  }
+  buffer->bits -= 32;
+}
+
+/* appends n_bits bits of a compressed strip */
+static void
+gifenc_buffer_append_bits (EncodeBuffer *buffer, const guint8 *data, gsize n_bits)
+{
+  guint32 word;
+
+  for (; n_bits >= 32; n_bits -= 32) {
+    memcpy (&word, data, 4);
+    gifenc_buffer_append (buffer, GUINT32_FROM_LE (word), 32);
+    data += 4;
+  }
+  for (; n_bits >= 8; n_bits -= 8) {
+    gifenc_buffer_append (buffer, *data, 8);
+    data++;
+  }
+  if (n_bits)
+    gifenc_buffer_append (buffer, *data & ((1 << n_bits) - 1), n_bits);
+}
+
+/* finishes image data written into enc->data */
 static void
 gifenc_buffer_flush (Gifenc *enc, EncodeBuffer *buffer)
 {
-  if (buffer->bits)
-    gifenc_buffer_append (enc, buffer, 0, 8 - buffer->bits);
-  gifenc_buffer_write (enc, buffer);
+  g_assert (buffer->data == enc->data);
+
+  gifenc_buffer_write_bytes (buffer, (buffer->bits + 7) / 8);
+  buffer->bits = 0;
+  gifenc_buffer_finish_block (buffer);
+  enc->len = buffer->len;
   gifenc_write_byte (enc, 0);
 }
 
+/* writes the last codeword and a clear or eof code with the width the
+ * decoder expects. The decoder adds a code for the last codeword, too. */
 static void
-gifenc_write_image_data (Gifenc *enc, const GifencImage *image)
+gifenc_lzw_finish (EncodeBuffer *buffer, guint codeword, guint count,
+    guint wordsize, guint terminator)
+{
+  gifenc_buffer_append (buffer, codeword, wordsize);
+  if (count == (1u << wordsize) && wordsize < 12)
+    wordsize++;
+  gifenc_buffer_append (buffer, terminator, wordsize);
+}
+
+/* The LZW loops below share the code layout, they only differ in how they
+ * find the code for the string (codeword, cur). They start right after a
+ * clear code and end with the given terminator. */
+
+/* hash lookup: small, but needs probing and a memset on every clear code */
+static void
+gifenc_write_image_data_hash (const GifencImage *image, EncodeBuffer *buffer,
+    guint codesize, guint terminator)
 {
-  guint codesize, wordsize, x, y;
+  guint wordsize, x, y;
   guint next = 0, count = 0, clear, eof, hashcode, hashvalue, cur, codeword;
   guint8 *data;
 #define HASH_SIZE (5003)
@@ -244,19 +376,12 @@ gifenc_write_image_data (Gifenc *enc, const GifencImage *image)
     guint value;
     guint code;
   } hash[HASH_SIZE];
-  EncodeBuffer buffer = { { 0, }, 0, 0, 0 };
   
-  codesize = log2n (gifenc_palette_get_num_colors (image->palette ? 
-	image->palette : enc->palette) - 1);
-  codesize = MAX (codesize, 2);
-  gifenc_write_byte (enc, codesize);
-  //g_print ("codesize with %u palette is %u\n", enc->n_palette, codesize);
   clear = 1 << codesize;
   eof = clear + 1;
   codeword = cur = *image->data;
   //g_print ("read byte %u\n", cur);
   wordsize = codesize + 1;
-  gifenc_buffer_append (enc, &buffer, clear, wordsize);
   if (1 == image->width) {
     y = 1;
     x = 0;
@@ -267,6 +392,8 @@ gifenc_write_image_data (Gifenc *enc, const GifencImage *image)
     data = image->data;
   }
 
+  /* in case there is only one pixel */
+  count = eof + 1;
   while (y < image->height) {
     count = eof + 1;
     next = (1 << wordsize);
@@ -296,13 +423,14 @@ loop:
       hash[hashcode].value = hashvalue;
       hash[hashcode].code = count;
       //g_print ("saving as %u (%X):", count, count);
-      gifenc_buffer_append (enc, &buffer, codeword, wordsize);
+      gifenc_buffer_append (buffer, codeword, wordsize);
       count++;
       codeword = cur;
       if (count > next) {
 	if (wordsize == 12) {
-	  gifenc_buffer_append (enc, &buffer, clear, wordsize);
+	  gifenc_buffer_append (buffer, clear, wordsize);
 	  wordsize = codesize + 1;
+	  count = eof + 1;
 	  break;
 	}
 	next = MIN (next << 1, 0xFFF);
@@ -310,15 +438,390 @@ loop:
       }
     }
   }
-  gifenc_buffer_append (enc, &buffer, codeword, wordsize);
-  if (count == next) {
-    wordsize++;
-    if (wordsize > 12) {
-      wordsize = codesize + 1;
-      gifenc_buffer_append (enc, &buffer, clear, wordsize);
+  gifenc_lzw_finish (buffer, codeword, count, wordsize, terminator);
+#undef HASH_SIZE
+}
+
+/* direct-indexed lookup: table[code * 256 + pixel] holds the code for every
+ * string. Entries are never cleared, instead an entry is only valid if it
+ * points to a code that was assigned after the last clear code and that
+ * code still maps back to the same string. */
+static void
+gifenc_write_image_data_table (guint16 *table, const GifencImage *image,
+    EncodeBuffer *buffer, guint codesize, guint terminator)
+{
+  guint wordsize, x, y;
+  guint next = 0, count = 0, clear, eof, cur, codeword, code;
+  guint8 *data;
+  guint16 prefix[LZW_MAX_CODES];
+  guint8 suffix[LZW_MAX_CODES];
+  
+  clear = 1 << codesize;
+  eof = clear + 1;
+  codeword = cur = *image->data;
+  wordsize = codesize + 1;
+  if (1 == image->width) {
+    y = 1;
+    x = 0;
+    data = image->data + image->rowstride;
+  } else {
+    y = 0;
+    x = 1;
+    data = image->data;
+  }
+
+  /* in case there is only one pixel */
+  count = eof + 1;
+  while (y < image->height) {
+    /* clearing is free: all codes >= count are invalid */
+    count = eof + 1;
+    next = (1 << wordsize);
+    while (y < image->height) {
+      cur = data[x];
+      x++;
+      if (x >= image->width) {
+	y++;
+	x = 0;
+	data += image->rowstride;
+      }
+      code = table[(codeword << 8) | cur];
+      if (code > eof && code < count &&
+	  prefix[code] == codeword && suffix[code] == cur) {
+	codeword = code;
+	continue;
+      }
+      /* not found, assign a new code */
+      table[(codeword << 8) | cur] = count;
+      prefix[count] = codeword;
+      suffix[count] = cur;
+      gifenc_buffer_append (buffer, codeword, wordsize);
+      count++;
+      codeword = cur;
+      if (count > next) {
+	if (wordsize == 12) {
+	  gifenc_buffer_append (buffer, clear, wordsize);
+	  wordsize = codesize + 1;
+	  count = eof + 1;
+	  break;
+	}
+	next = MIN (next << 1, 0xFFF);
+	wordsize++;
+      }
+    }
+  }
+  gifenc_lzw_finish (buffer, codeword, count, wordsize, terminator);
+}
+
+/* like the table lookup, but pixels with the alpha index may also be encoded
+ * as the pixel in image->previous if only that continues the current string.
+ * New strings start with the alpha index, runs of it compress best. */
+static void
+gifenc_write_image_data_wildcard (guint16 *table, const GifencImage *image,
+    EncodeBuffer *buffer, guint codesize, guint alpha, guint terminator)
+{
+  guint wordsize, x, y;
+  guint next = 0, count = 0, clear, eof, cur, alt, codeword, code;
+  guint8 *data, *previous;
+  guint16 prefix[LZW_MAX_CODES];
+  guint8 suffix[LZW_MAX_CODES];
+  
+  clear = 1 << codesize;
+  eof = clear + 1;
+  codeword = *image->data;
+  wordsize = codesize + 1;
+  if (1 == image->width) {
+    y = 1;
+    x = 0;
+    data = image->data + image->rowstride;
+    previous = image->previous + image->previous_rowstride;
+  } else {
+    y = 0;
+    x = 1;
+    data = image->data;
+    previous = image->previous;
+  }
+
+  /* in case there is only one pixel */
+  count = eof + 1;
+  while (y < image->height) {
+    count = eof + 1;
+    next = (1 << wordsize);
+    while (y < image->height) {
+      cur = data[x];
+      alt = previous[x];
+      x++;
+      if (x >= image->width) {
+	y++;
+	x = 0;
+	data += image->rowstride;
+	previous += image->previous_rowstride;
+      }
+      code = table[(codeword << 8) | cur];
+      if (code > eof && code < count &&
+	  prefix[code] == codeword && suffix[code] == cur) {
+	codeword = code;
+	continue;
+      }
+      if (cur == alpha) {
+	code = table[(codeword << 8) | alt];
+	if (code > eof && code < count &&
+	    prefix[code] == codeword && suffix[code] == alt) {
+	  codeword = code;
+	  continue;
+	}
+      }
+      /* not found, assign a new code */
+      table[(codeword << 8) | cur] = count;
+      prefix[count] = codeword;
+      suffix[count] = cur;
+      gifenc_buffer_append (buffer, codeword, wordsize);
+      count++;
+      codeword = cur;
+      if (count > next) {
+	if (wordsize == 12) {
+	  gifenc_buffer_append (buffer, clear, wordsize);
+	  wordsize = codesize + 1;
+	  count = eof + 1;
+	  break;
+	}
+	next = MIN (next << 1, 0xFFF);
+	wordsize++;
+      }
+    }
+  }
+  gifenc_lzw_finish (buffer, codeword, count, wordsize, terminator);
+}
+
+static guint
+gifenc_color_distance (guint32 a, guint32 b)
+{
+  gint r, g, b_;
+
+  r = (gint) RED (a) - RED (b);
+  g = (gint) GREEN (a) - GREEN (b);
+  b_ = (gint) BLUE (a) - BLUE (b);
+  return r * r + g * g + b_ * b_;
+}
+
+/* like the wildcard lookup, but if no string matches exactly, the string is
+ * continued with the closest color that is at most max_error away. All
+ * extensions of a string are kept in a list for that. */
+static void
+gifenc_write_image_data_lossy (guint16 *table, const GifencImage *image,
+    EncodeBuffer *buffer, guint codesize, const GifencPalette *palette, 
+    guint max_error, guint terminator)
+{
+  guint wordsize, x, y;
+  guint next = 0, count = 0, clear, eof, cur, alt, ref, codeword, code;
+  guint alpha, best, best_error, error;
+  guint8 *data, *previous;
+  guint16 prefix[LZW_MAX_CODES];
+  guint8 suffix[LZW_MAX_CODES];
+  guint16 first_child[LZW_MAX_CODES];
+  guint16 next_sibling[LZW_MAX_CODES];
+  
+  alpha = palette->alpha ? gifenc_palette_get_alpha_index (palette) : G_MAXUINT;
+  max_error = max_error * max_error;
+  memset (first_child, 0, sizeof (first_child));
+  clear = 1 << codesize;
+  eof = clear + 1;
+  codeword = *image->data;
+  wordsize = codesize + 1;
+  previous = image->previous;
+  if (1 == image->width) {
+    y = 1;
+    x = 0;
+    data = image->data + image->rowstride;
+    if (previous)
+      previous += image->previous_rowstride;
+  } else {
+    y = 0;
+    x = 1;
+    data = image->data;
+  }
+  alt = alpha;
+
+#define VALID(code, codeword, cur) ((code) > eof && (code) < count && \
+    prefix[code] == (codeword) && suffix[code] == (cur))
+  /* in case there is only one pixel */
+  count = eof + 1;
+  while (y < image->height) {
+    count = eof + 1;
+    next = (1 << wordsize);
+    while (y < image->height) {
+      cur = data[x];
+      if (previous)
+	alt = previous[x];
+      x++;
+      if (x >= image->width) {
+	y++;
+	x = 0;
+	data += image->rowstride;
+	if (previous)
+	  previous += image->previous_rowstride;
+      }
+      code = table[(codeword << 8) | cur];
+      if (VALID (code, codeword, cur)) {
+	codeword = code;
+	continue;
+      }
+      if (cur == alpha) {
+	code = table[(codeword << 8) | alt];
+	if (VALID (code, codeword, alt)) {
+	  codeword = code;
+	  continue;
+	}
+	ref = alt;
+      } else {
+	ref = cur;
+      }
+      /* transparency is never approximated */
+      if (ref != alpha) {
+	best = 0;
+	best_error = max_error + 1;
+	for (code = first_child[codeword]; VALID (code, codeword, suffix[code]);
+	    code = next_sibling[code]) {
+	  if (suffix[code] == alpha)
+	    continue;
+	  error = gifenc_color_distance (palette->colors[suffix[code]], 
+	      palette->colors[ref]);
+	  if (error < best_error) {
+	    best = code;
+	    best_error = error;
+	  }
+	}
+	if (best) {
+	  codeword = best;
+	  continue;
+	}
+      }
+      /* not found, assign a new code */
+      table[(codeword << 8) | cur] = count;
+      prefix[count] = codeword;
+      suffix[count] = cur;
+      code = first_child[codeword];
+      next_sibling[count] = VALID (code, codeword, suffix[code]) ? code : 0;
+      first_child[codeword] = count;
+      gifenc_buffer_append (buffer, codeword, wordsize);
+      count++;
+      codeword = cur;
+      if (count > next) {
+	if (wordsize == 12) {
+	  gifenc_buffer_append (buffer, clear, wordsize);
+	  wordsize = codesize + 1;
+	  count = eof + 1;
+	  break;
+	}
+	next = MIN (next << 1, 0xFFF);
+	wordsize++;
+      }
     }
   }
-  gifenc_buffer_append (enc, &buffer, eof, wordsize);
+#undef VALID
+  gifenc_lzw_finish (buffer, codeword, count, wordsize, terminator);
+}
+
+/* code tables are handed out per call so strips can be compressed from
+ * multiple threads */
+static guint16 *
+gifenc_acquire_lzw_table (Gifenc *enc)
+{
+  guint16 *table;
+
+  table = g_async_queue_try_pop (enc->lzw_tables);
+  if (table == NULL)
+    table = g_new0 (guint16, LZW_MAX_CODES * 256);
+  return table;
+}
+
+static void
+gifenc_release_lzw_table (Gifenc *enc, guint16 *table)
+{
+  g_async_queue_push (enc->lzw_tables, table);
+}
+
+static guint
+gifenc_get_codesize (Gifenc *enc, const GifencImage *image)
+{
+  guint codesize;
+
+  codesize = log2n (gifenc_palette_get_num_colors (image->palette ? 
+	image->palette : enc->palette) - 1);
+  return MAX (codesize, 2);
+}
+
+/* Compresses the rows of image. Image data can be compressed in strips: the
+ * first strip starts with a clear code and every strip but the last one ends
+ * with one, so the decoder starts every strip with an empty dictionary. */
+static void
+gifenc_compress (Gifenc *enc, const GifencImage *image, EncodeBuffer *buffer,
+    gboolean first, gboolean last)
+{
+  GifencPalette *palette;
+  guint codesize, clear, terminator;
+  guint16 *table;
+
+  palette = image->palette ? image->palette : enc->palette;
+  codesize = gifenc_get_codesize (enc, image);
+  clear = 1 << codesize;
+  terminator = last ? clear + 1 : clear;
+  if (first)
+    gifenc_buffer_append (buffer, clear, codesize + 1);
+
+  if (enc->lossy > 0) {
+    table = gifenc_acquire_lzw_table (enc);
+    gifenc_write_image_data_lossy (table, image, buffer, codesize, palette, 
+	enc->lossy, terminator);
+    gifenc_release_lzw_table (enc, table);
+    return;
+  }
+
+  if (image->previous && palette->alpha) {
+    table = gifenc_acquire_lzw_table (enc);
+    gifenc_write_image_data_wildcard (table, image, buffer, codesize,
+	gifenc_palette_get_alpha_index (palette), terminator);
+    gifenc_release_lzw_table (enc, table);
+    return;
+  }
+
+  switch (enc->lzw_engine) {
+    case GIFENC_LZW_HASH:
+      gifenc_write_image_data_hash (image, buffer, codesize, terminator);
+      break;
+    case GIFENC_LZW_TABLE:
+      table = gifenc_acquire_lzw_table (enc);
+      gifenc_write_image_data_table (table, image, buffer, codesize, terminator);
+      gifenc_release_lzw_table (enc, table);
+      break;
+    default:
+      g_assert_not_reached ();
+      break;
+  }
+}
+
+static void
+gifenc_write_image_data (Gifenc *enc, const GifencImage *image)
+{
+  EncodeBuffer buffer;
+  
+  gifenc_write_byte (enc, gifenc_get_codesize (enc, image));
+  gifenc_buffer_init (&buffer, enc->data, enc->len, enc->size, TRUE);
+  gifenc_compress (enc, image, &buffer, TRUE, TRUE);
+  gifenc_buffer_flush (enc, &buffer);
+}
+
+static void
+gifenc_write_image_strips (Gifenc *enc, const GifencImage *image,
+    GifencStrip **strips, guint n_strips)
+{
+  EncodeBuffer buffer;
+  guint i;
+  
+  gifenc_write_byte (enc, gifenc_get_codesize (enc, image));
+  gifenc_buffer_init (&buffer, enc->data, enc->len, enc->size, TRUE);
+  for (i = 0; i < n_strips; i++) {
+    gifenc_buffer_append_bits (&buffer, strips[i]->data, strips[i]->n_bits);
+  }
   gifenc_buffer_flush (enc, &buffer);
 }
 
@@ -344,7 +847,7 @@ gifenc_write_loop (Gifenc *enc)
   gifenc_write_byte (enc, 0x21); /* extension */
   gifenc_write_byte (enc, 0xFF); /* application extension */
   gifenc_write_byte (enc, 11); /* block size */
-  g_byte_array_append (enc->buffer, (guint8 *) "NETSCAPE2.0", 11);
+  gifenc_write (enc, (guint8 *) "NETSCAPE2.0", 11);
   gifenc_write_byte (enc, 3); /* block size */
   gifenc_write_byte (enc, 1); /* ??? */
   gifenc_write_byte (enc, 0); /* ??? */
@@ -352,29 +855,256 @@ gifenc_write_loop (Gifenc *enc)
   gifenc_write_byte (enc, 0); /* block terminator */
 }
 
-/*** PUBLIC API ***/
+/*** PARALLEL COMPRESSION ***/
 
-Gifenc *
-gifenc_new (guint width, guint height, GifencWriteFunc write_func, 
-    gpointer write_data, GDestroyNotify write_destroy)
+static gboolean
+gifenc_write_strips (Gifenc *enc, const GifencImage *image, 
+    guint display_millis, GifencStrip **strips, guint n_strips, GError **error)
 {
-  Gifenc *enc;
-
-  g_return_val_if_fail (width <= G_MAXUINT16, NULL);
-  g_return_val_if_fail (height <= G_MAXUINT16, NULL);
-  g_return_val_if_fail (write_func, NULL);
-  
-  enc = g_slice_new0 (Gifenc);
-  enc->width = width;
-  enc->height = height;
-  enc->buffer = g_byte_array_new ();
-  enc->write_func = write_func;
-  enc->write_data = write_data;
-  enc->write_destroy = write_destroy;
+  gsize bytes;
+  guint i;
+
+  bytes = 0;
+  for (i = 0; i < n_strips; i++) {
+    bytes += (strips[i]->n_bits + 7) / 8;
+  }
+  bytes += bytes / 255 + 8;
+  gifenc_begin (enc, GIFENC_MAX_HEADER_SIZE + bytes);
+  gifenc_write_graphic_control (enc, image->palette ? image->palette : enc->palette,
+      display_millis);
+  gifenc_write_image_description (enc, image);
+  gifenc_write_image_strips (enc, image, strips, n_strips);
+  return gifenc_flush (enc, error);
+}
+
+typedef struct {
+  GifencStrip *strip;
+  GifencImage image;
+  gboolean first;
+  gboolean last;
+} GifencStripJob;
+
+static void
+gifenc_strip_compress_image (Gifenc *enc, GifencStrip *strip,
+    const GifencImage *image, gboolean first, gboolean last)
+{
+  EncodeBuffer buffer;
+  gsize size;
+
+  size = gifenc_get_image_size_bound (image->width, image->height);
+  if (strip->size < size) {
+    g_free (strip->data);
+    strip->data = g_malloc (size);
+    strip->size = size;
+  }
+  gifenc_buffer_init (&buffer, strip->data, 0, strip->size, FALSE);
+  gifenc_compress (enc, image, &buffer, first, last);
+  strip->n_bits = buffer.len * 8 + buffer.bits;
+  gifenc_buffer_write_bytes (&buffer, (buffer.bits + 7) / 8);
+  g_assert (buffer.len <= strip->size);
+}
+
+static void
+gifenc_strip_job_run (gpointer data, gpointer enc_ptr)
+{
+  Gifenc *enc = enc_ptr;
+  GifencStripJob *job = data;
+
+  gifenc_strip_compress_image (enc, job->strip, &job->image, job->first, job->last);
+
+  g_mutex_lock (&enc->strip_mutex);
+  enc->strips_pending--;
+  if (enc->strips_pending == 0)
+    g_cond_signal (&enc->strip_cond);
+  g_mutex_unlock (&enc->strip_mutex);
+}
+
+static gboolean
+gifenc_add_image_parallel (Gifenc *enc, const GifencImage *image, 
+    guint display_millis, GError **error)
+{
+  GifencStripJob jobs[GIFENC_MAX_STRIPS];
+  guint i, y, rows, n_strips;
+
+  n_strips = MIN (enc->n_threads, 
+      (guint64) image->width * image->height / GIFENC_STRIP_PIXELS);
+  n_strips = MIN (n_strips, image->height);
+  rows = (image->height + n_strips - 1) / n_strips;
+  n_strips = (image->height + rows - 1) / rows;
+
+  for (i = 0, y = 0; i < n_strips; i++, y += rows) {
+    if (enc->strips[i] == NULL)
+      enc->strips[i] = gifenc_strip_new ();
+    jobs[i].strip = enc->strips[i];
+    jobs[i].image = *image;
+    jobs[i].image.y += y;
+    jobs[i].image.height = MIN (rows, image->height - y);
+    jobs[i].image.data += y * image->rowstride;
+    if (image->previous)
+      jobs[i].image.previous += y * image->previous_rowstride;
+    jobs[i].first = i == 0;
+    jobs[i].last = i == n_strips - 1;
+  }
+
+  enc->strips_pending = n_strips - 1;
+  for (i = 1; i < n_strips; i++) {
+    g_thread_pool_push (enc->strip_pool, &jobs[i], NULL);
+  }
+  gifenc_strip_compress_image (enc, jobs[0].strip, &jobs[0].image, 
+      jobs[0].first, jobs[0].last);
+  g_mutex_lock (&enc->strip_mutex);
+  while (enc->strips_pending > 0)
+    g_cond_wait (&enc->strip_cond, &enc->strip_mutex);
+  g_mutex_unlock (&enc->strip_mutex);
+
+  return gifenc_write_strips (enc, image, display_millis, enc->strips, 
+      n_strips, error);
+}
+
+static gboolean
+gifenc_write_image (Gifenc *enc, const GifencImage *image, 
+    guint display_millis, GError **error)
+{
+  if (enc->n_threads > 1 && image->height > 1 &&
+      (guint64) image->width * image->height >= 2 * GIFENC_STRIP_PIXELS)
+    return gifenc_add_image_parallel (enc, image, display_millis, error);
+
+  //g_print ("adding image (display time %u)\n", display_millis);
+  gifenc_begin (enc, gifenc_get_image_size_bound (image->width, image->height));
+  gifenc_write_graphic_control (enc, image->palette ? image->palette : enc->palette, 
+      display_millis);
+  gifenc_write_image_description (enc, image);
+  gifenc_write_image_data (enc, image);
+  return gifenc_flush (enc, error);
+}
+
+/* runs on the dither threads, see gifenc_dither() */
+static void gifenc_dither_job_run (gpointer data, gpointer enc_ptr);
+
+/*** PUBLIC API ***/
+
+Gifenc *
+gifenc_new (guint width, guint height, GifencWriteFunc write_func, 
+    gpointer write_data, GDestroyNotify write_destroy)
+{
+  Gifenc *enc;
+
+  g_return_val_if_fail (width <= G_MAXUINT16, NULL);
+  g_return_val_if_fail (height <= G_MAXUINT16, NULL);
+  g_return_val_if_fail (write_func, NULL);
+  
+  enc = g_slice_new0 (Gifenc);
+  enc->width = width;
+  enc->height = height;
+  enc->write_func = write_func;
+  enc->write_data = write_data;
+  enc->write_destroy = write_destroy;
+  enc->lzw_engine = GIFENC_LZW_TABLE;
+  enc->lzw_tables = g_async_queue_new_full (g_free);
+  enc->n_threads = 1;
+  g_mutex_init (&enc->strip_mutex);
+  g_cond_init (&enc->strip_cond);
+  g_mutex_init (&enc->dither_mutex);
+  g_cond_init (&enc->dither_cond);
+  /* allow benchmarking the engines against each other on plain images,
+   * lossy images and images with a previous one always use the table */
+  if (g_strcmp0 (g_getenv ("GIFENC_LZW"), "hash") == 0)
+    enc->lzw_engine = GIFENC_LZW_HASH;
+  if (g_strcmp0 (g_getenv ("GIFENC_QUANTIZER"), "wu") == 0)
+    enc->quantizer = GIFENC_QUANTIZER_WU;
 
   return enc;
 }
 
+/**
+ * gifenc_set_lzw_engine:
+ * @enc: the encoder
+ * @engine: dictionary to use
+ *
+ * Sets the dictionary used for compressing plain images. Images added with
+ * gifenc_add_image_with_previous() to a palette with transparency and all
+ * images when gifenc_set_lossy() is in effect always use %GIFENC_LZW_TABLE,
+ * as only it can look up alternative strings.
+ **/
+void
+gifenc_set_lzw_engine (Gifenc *enc, GifencLzwEngine engine)
+{
+  g_return_if_fail (enc != NULL);
+
+  enc->lzw_engine = engine;
+}
+
+/**
+ * gifenc_set_quantizer:
+ * @enc: the encoder
+ * @quantizer: algorithm to use
+ *
+ * Selects the algorithm users of @enc should pass to 
+ * gifenc_quantize_histogram() when creating the palette. The octree is the 
+ * default, it can be changed with GIFENC_QUANTIZER=wu for benchmarking.
+ **/
+void
+gifenc_set_quantizer (Gifenc *enc, GifencQuantizer quantizer)
+{
+  g_return_if_fail (enc != NULL);
+
+  enc->quantizer = quantizer;
+}
+
+/**
+ * gifenc_set_lossy:
+ * @enc: the encoder
+ * @max_error: maximum distance between two colors in RGB space that may be
+ *             used for each other or 0 to encode losslessly
+ *
+ * Allows the LZW encoder to continue a string with a similar color if no
+ * string matches exactly. This makes images considerably smaller, at the
+ * expense of some noise.
+ **/
+void
+gifenc_set_lossy (Gifenc *enc, guint max_error)
+{
+  g_return_if_fail (enc != NULL);
+
+  enc->lossy = max_error;
+}
+
+/**
+ * gifenc_set_n_threads:
+ * @enc: the encoder
+ * @n_threads: number of threads to compress large images with
+ *
+ * Images of at least GIFENC_STRIP_PIXELS pixels added with 
+ * gifenc_add_image() are split into up to @n_threads strips that are 
+ * compressed in parallel. The same goes for the rows of images dithered 
+ * with gifenc_dither_rgb_threaded() and friends. Setting @n_threads to 1 
+ * disables this.
+ **/
+void
+gifenc_set_n_threads (Gifenc *enc, guint n_threads)
+{
+  g_return_if_fail (enc != NULL);
+  g_return_if_fail (n_threads > 0);
+
+  n_threads = MIN (n_threads, GIFENC_MAX_STRIPS);
+  if (enc->strip_pool) {
+    g_thread_pool_free (enc->strip_pool, FALSE, TRUE);
+    enc->strip_pool = NULL;
+  }
+  if (enc->dither_pool) {
+    g_thread_pool_free (enc->dither_pool, FALSE, TRUE);
+    enc->dither_pool = NULL;
+  }
+  /* the calling thread compresses a strip or dithers rows, too */
+  if (n_threads > 1) {
+    enc->strip_pool = g_thread_pool_new (gifenc_strip_job_run, enc, 
+	n_threads - 1, FALSE, NULL);
+    enc->dither_pool = g_thread_pool_new (gifenc_dither_job_run, enc, 
+	n_threads - 1, FALSE, NULL);
+  }
+  enc->n_threads = n_threads;
+}
+
 gboolean
 gifenc_initialize (Gifenc *enc, GifencPalette *palette, gboolean loop, GError **error)
 {
@@ -382,6 +1112,7 @@ gifenc_initialize (Gifenc *enc, GifencPalette *palette, gboolean loop, GError **
   g_return_val_if_fail (enc->state == GIFENC_STATE_NEW, FALSE);
   g_return_val_if_fail (palette != NULL, FALSE);
 
+  gifenc_begin (enc, GIFENC_MAX_HEADER_SIZE);
   gifenc_write_header (enc);
   gifenc_write_lsd (enc, palette);
   gifenc_write_color_table (enc, palette);
@@ -408,12 +1139,166 @@ gifenc_add_image (Gifenc *enc, guint x, guint y, guint width, guint height,
   g_return_val_if_fail (height > 0, FALSE);
   g_return_val_if_fail (y + height <= enc->height, FALSE);
 
-  //g_print ("adding image (display time %u)\n", display_millis);
-  gifenc_write_graphic_control (enc, image.palette ? image.palette : enc->palette, 
-      display_millis);
-  gifenc_write_image_description (enc, &image);
-  gifenc_write_image_data (enc, &image);
-  return gifenc_flush (enc, error);
+  return gifenc_write_image (enc, &image, display_millis, error);
+}
+
+/**
+ * gifenc_add_image_with_previous:
+ * @enc: the encoder
+ * @x: x coordinate of the image
+ * @y: y coordinate of the image
+ * @width: width of the image
+ * @height: height of the image
+ * @display_millis: time to display the image
+ * @data: the image
+ * @rowstride: rowstride of @data
+ * @previous: what is shown at the position of the image already
+ * @previous_rowstride: rowstride of @previous
+ * @error: location for an error or %NULL
+ *
+ * Like gifenc_add_image(), but pixels of @data that use the alpha index 
+ * may be encoded with the color of @previous instead when that gives 
+ * longer LZW matches. Both show the same result.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gifenc_add_image_with_previous (Gifenc *enc, guint x, guint y, guint width,
+    guint height, guint display_millis, guint8 *data, guint rowstride,
+    guint8 *previous, guint previous_rowstride, GError **error)
+{
+  GifencImage image = { x, y, width, height, NULL, data, rowstride,
+      previous, previous_rowstride };
+
+  g_return_val_if_fail (enc != NULL, FALSE);
+  g_return_val_if_fail (enc->state == GIFENC_STATE_INITIALIZED, FALSE);
+  g_return_val_if_fail (width > 0, FALSE);
+  g_return_val_if_fail (x + width <= enc->width, FALSE);
+  g_return_val_if_fail (height > 0, FALSE);
+  g_return_val_if_fail (y + height <= enc->height, FALSE);
+  g_return_val_if_fail (previous != NULL, FALSE);
+
+  return gifenc_write_image (enc, &image, display_millis, error);
+}
+
+/**
+ * gifenc_add_image_with_palette:
+ * @enc: the encoder
+ * @x: x coordinate of the image
+ * @y: y coordinate of the image
+ * @width: width of the image
+ * @height: height of the image
+ * @display_millis: time to display the image
+ * @palette: palette of @data, written as a local color table
+ * @data: the image
+ * @rowstride: rowstride of @data
+ * @error: location for an error or %NULL
+ *
+ * Like gifenc_add_image(), but the indexes of @data refer to @palette 
+ * instead of the palette passed to gifenc_initialize(). This is useful 
+ * when the image shows colors the global palette does not have. The 
+ * palette must stay alive until the function returns.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gifenc_add_image_with_palette (Gifenc *enc, guint x, guint y, guint width,
+    guint height, guint display_millis, GifencPalette *palette, guint8 *data, 
+    guint rowstride, GError **error)
+{
+  GifencImage image = { x, y, width, height, palette, data, rowstride };
+
+  g_return_val_if_fail (enc != NULL, FALSE);
+  g_return_val_if_fail (enc->state == GIFENC_STATE_INITIALIZED, FALSE);
+  g_return_val_if_fail (width > 0, FALSE);
+  g_return_val_if_fail (x + width <= enc->width, FALSE);
+  g_return_val_if_fail (height > 0, FALSE);
+  g_return_val_if_fail (y + height <= enc->height, FALSE);
+  g_return_val_if_fail (palette != NULL, FALSE);
+
+  return gifenc_write_image (enc, &image, display_millis, error);
+}
+
+/**
+ * gifenc_strip_compress:
+ * @enc: the encoder
+ * @strip: the strip to compress into
+ * @data: first row of the strip
+ * @width: width of the image
+ * @height: number of rows in the strip
+ * @rowstride: rowstride of @data
+ * @first: %TRUE for the top strip of the image
+ * @last: %TRUE for the bottom strip of the image
+ *
+ * Compresses a horizontal strip of an image for gifenc_add_image_strips().
+ * The strips of one image can be compressed in any order and from any 
+ * thread, but the encoder must not be modified meanwhile.
+ **/
+void
+gifenc_strip_compress (Gifenc *enc, GifencStrip *strip, guint8 *data,
+    guint width, guint height, guint rowstride, gboolean first, gboolean last)
+{
+  GifencImage image = { 0, 0, width, height, NULL, data, rowstride };
+
+  g_return_if_fail (enc != NULL);
+  g_return_if_fail (enc->state == GIFENC_STATE_INITIALIZED);
+  g_return_if_fail (strip != NULL);
+  g_return_if_fail (width > 0);
+  g_return_if_fail (height > 0);
+
+  gifenc_strip_compress_image (enc, strip, &image, first, last);
+}
+
+/**
+ * gifenc_add_image_strips:
+ * @enc: the encoder
+ * @x: x coordinate of the image
+ * @y: y coordinate of the image
+ * @width: width of the image
+ * @height: height of the image
+ * @display_millis: time to display the image
+ * @strips: the compressed strips of the image from top to bottom
+ * @n_strips: number of strips
+ * @error: location for an error or %NULL
+ *
+ * Adds an image that was compressed with gifenc_strip_compress(). The 
+ * strips are written as the data of a single image.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gifenc_add_image_strips (Gifenc *enc, guint x, guint y, guint width, 
+    guint height, guint display_millis, GifencStrip **strips, guint n_strips,
+    GError **error)
+{
+  GifencImage image = { x, y, width, height, NULL, NULL, 0 };
+
+  g_return_val_if_fail (enc != NULL, FALSE);
+  g_return_val_if_fail (enc->state == GIFENC_STATE_INITIALIZED, FALSE);
+  g_return_val_if_fail (width > 0, FALSE);
+  g_return_val_if_fail (x + width <= enc->width, FALSE);
+  g_return_val_if_fail (height > 0, FALSE);
+  g_return_val_if_fail (y + height <= enc->height, FALSE);
+  g_return_val_if_fail (strips != NULL, FALSE);
+  g_return_val_if_fail (n_strips > 0, FALSE);
+
+  return gifenc_write_strips (enc, &image, display_millis, strips, n_strips, 
+      error);
+}
+
+GifencStrip *
+gifenc_strip_new (void)
+{
+  return g_slice_new0 (GifencStrip);
+}
+
+void
+gifenc_strip_free (GifencStrip *strip)
+{
+  g_return_if_fail (strip != NULL);
+
+  g_free (strip->data);
+  g_slice_free (GifencStrip, strip);
 }
 
 gboolean
@@ -422,6 +1307,7 @@ gifenc_close (Gifenc *enc, GError **error)
   g_return_val_if_fail (enc != NULL, FALSE);
   g_return_val_if_fail (enc->state == GIFENC_STATE_INITIALIZED, FALSE);
 
+  gifenc_begin (enc, 1);
   gifenc_write_byte (enc, 0x3B);
   if (!gifenc_flush (enc, error))
     return FALSE;
@@ -434,6 +1320,7 @@ gboolean
 gifenc_free (Gifenc *enc)
 {
   gboolean success;
+  guint i;
 
   g_return_val_if_fail (enc != NULL, FALSE);
 
@@ -443,7 +1330,20 @@ gifenc_free (Gifenc *enc)
     enc->write_destroy (enc->write_data);
   if (enc->palette)
     gifenc_palette_free (enc->palette);
-  g_byte_array_unref (enc->buffer);
+  if (enc->strip_pool)
+    g_thread_pool_free (enc->strip_pool, FALSE, TRUE);
+  if (enc->dither_pool)
+    g_thread_pool_free (enc->dither_pool, FALSE, TRUE);
+  for (i = 0; i < G_N_ELEMENTS (enc->strips); i++) {
+    if (enc->strips[i])
+      gifenc_strip_free (enc->strips[i]);
+  }
+  g_free (enc->arena);
+  g_async_queue_unref (enc->lzw_tables);
+  g_mutex_clear (&enc->strip_mutex);
+  g_cond_clear (&enc->strip_cond);
+  g_mutex_clear (&enc->dither_mutex);
+  g_cond_clear (&enc->dither_cond);
   g_slice_free (Gifenc, enc);
 
   return success;
@@ -471,59 +1371,493 @@ gifenc_get_height (Gifenc *gifenc)
 #define FACTOR2 (41)
 #define FACTOR_FRONT (113)
 
+/* ints per pixel in an error row: the fourth is unused so the SSE2 code can
+ * load all channels at once. Rows have an extra pixel on both sides. */
+#define GIFENC_DITHER_ERROR_ROW(width) (((width) + 2) * 4)
+/* pixels dithered between checks of the progress of the row above */
+#define GIFENC_DITHER_SPAN 64
+
+#define GIFENC_CACHE_LINE 64
+#define GIFENC_ALIGN(x, n) (((x) + (n) - 1) / (n) * (n))
+
+#ifdef GIFENC_DEBUG
+static gint gifenc_dither_n_allocations = 0;
+#define GIFENC_COUNT_ALLOCATION() g_atomic_int_inc (&gifenc_dither_n_allocations)
+#else
+#define GIFENC_COUNT_ALLOCATION() 
+#endif
+
+typedef struct {
+  const GifencPalette *	palette;
+  guint8 *		target;
+  guint			target_rowstride;
+  guint8 *		full;		/* NULL or image to compare with */
+  guint			full_rowstride;
+  guint8		alpha;		/* index for pixels equal to full */
+  const guint8 *	data;
+  guint			rowstride;
+  guint			width;
+  guint			height;
+  guint			error_channels;	/* channels that diffuse their error */
+  gboolean		ordered;	/* Bayer matrix instead of error diffusion */
+  guint			x;		/* position of data in the full image */
+  guint			y;
+  gint *		errors;		/* two error rows */
+  guint			error_rowstride; /* ints from one error row to the next */
+  gint *		progress;	/* pixels done per row or NULL if not threaded */
+  gint			next_row;	/* next row to dither, accessed atomically */
+  guint			pending;	/* threads still dithering */
+  cairo_rectangle_int_t	area;		/* changed pixels as x, y, right and bottom */
+} GifencDither;
+
+/* The SSE2 kernels keep the three channels of a pixel in one register and
+ * must produce exactly the same indices as the C code below, which is the
+ * reference. Error terms are at most 255 * FACTOR_FRONT, so they fit the
+ * 16bit multiplies of pmaddwd. Clamping is done by saturating packs. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GIFENC_HAVE_SSE2 1
+#include <emmintrin.h>
+
+static gboolean
+gifenc_use_sse2 (void)
+{
+  static gsize use_sse2 = 0;
+
+  if (g_once_init_enter (&use_sse2)) {
+    gboolean result = __builtin_cpu_supports ("sse2") &&
+	g_strcmp0 (g_getenv ("GIFENC_SIMD"), "none") != 0;
+    g_once_init_leave (&use_sse2, result ? 2 : 1);
+  }
+
+  return use_sse2 == 2;
+}
+
+#define GIFENC_SSE2 __attribute__ ((target ("sse2")))
+
+/* returns the pixel's channels as 32bit integers */
+static inline __m128i GIFENC_SSE2
+gifenc_sse2_load_pixel (guint32 pixel)
+{
+  __m128i zero = _mm_setzero_si128 ();
+
+  return _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (
+	_mm_cvtsi32_si128 (pixel & 0xFFFFFF), zero), zero);
+}
+
+/* clamps the channels to 0-255 and packs them into the low 32 bits */
+static inline __m128i GIFENC_SSE2
+gifenc_sse2_pack (__m128i v)
+{
+  return _mm_packus_epi16 (_mm_packs_epi32 (v, v), v);
+}
+
+/* diffuses one pixel: mask selects the channels that carry their error */
+static inline void GIFENC_SSE2
+gifenc_sse2_dither_pixel (__m128i *err, const gint *cur_error, 
+    gint *cur_next_error, const guint32 *row, __m128i mask, guint32 *pixel, 
+    __m128i *src)
+{
+  __m128i zero = _mm_setzero_si128 ();
+  __m128i v, clamped, e;
+
+  *src = gifenc_sse2_load_pixel (*row);
+  v = _mm_add_epi32 (*err, _mm_loadu_si128 ((const __m128i *) cur_error));
+  v = _mm_add_epi32 (_mm_srai_epi32 (v, 8), *src);
+  v = gifenc_sse2_pack (v);
+  *pixel = _mm_cvtsi128_si32 (v) & 0xFFFFFF;
+  clamped = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (v, zero), zero);
+
+  e = _mm_and_si128 (_mm_sub_epi32 (clamped, *src), mask);
+  _mm_storeu_si128 ((__m128i *) cur_next_error, _mm_add_epi32 (
+	_mm_loadu_si128 ((__m128i *) cur_next_error), 
+	_mm_madd_epi16 (e, _mm_set1_epi32 (FACTOR0))));
+  _mm_storeu_si128 ((__m128i *) (cur_next_error + 4), _mm_add_epi32 (
+	_mm_loadu_si128 ((__m128i *) (cur_next_error + 4)), 
+	_mm_madd_epi16 (e, _mm_set1_epi32 (FACTOR1))));
+  _mm_storeu_si128 ((__m128i *) (cur_next_error + 8), 
+      _mm_madd_epi16 (e, _mm_set1_epi32 (FACTOR2)));
+  *err = _mm_madd_epi16 (e, _mm_set1_epi32 (FACTOR_FRONT));
+}
+
+/* continues the error diffusion of a row for n pixels */
+static void GIFENC_SSE2
+gifenc_dither_span_sse2 (const GifencDither *dither, guint8 *target, 
+    const guint32 *row, const gint *cur_error, gint *cur_next_error, 
+    gint *err_state, guint n)
+{
+  const GifencPalette *palette = dither->palette;
+  __m128i err, src, mask;
+  guint32 pixel;
+  guint x;
+
+  if (dither->error_channels == 3)
+    mask = _mm_set_epi32 (0, -1, -1, -1);
+  else
+    mask = _mm_set_epi32 (0, 0, 0, -1);
+  err = _mm_loadu_si128 ((const __m128i *) err_state);
+  for (x = 0; x < n; x++) {
+    gifenc_sse2_dither_pixel (&err, cur_error, cur_next_error, row, mask,
+	&pixel, &src);
+    target[x] = palette->lookup (palette->data, pixel, &pixel);
+    row++;
+    cur_error += 4;
+    cur_next_error += 4;
+  }
+  _mm_storeu_si128 ((__m128i *) err_state, err);
+}
+#endif /* x86 */
+
+/* continues the error diffusion of a row for n pixels */
+static void
+gifenc_dither_span (const GifencDither *dither, guint8 *target, 
+    const guint32 *row, const gint *cur_error, gint *cur_next_error, 
+    gint *err, guint n)
+{
+  const GifencPalette *palette = dither->palette;
+  guint x, c;
+  guint32 pixel;
+
+#ifdef GIFENC_HAVE_SSE2
+  if (gifenc_use_sse2 ()) {
+    gifenc_dither_span_sse2 (dither, target, row, cur_error, cur_next_error,
+	err, n);
+    return;
+  }
+#endif
+
+  for (x = 0; x < n; x++) {
+    for (c = 0; c < 3; c++) {
+      err[c] = ((err[c] + cur_error[c]) >> 8) + (guint8) (*row >> 8 * c);
+      err[c] = CLAMP (err[c], 0, 0xFF);
+    }
+    pixel = COLOR (err[2], err[1], err[0]);
+    target[x] = palette->lookup (palette->data, pixel, &pixel);
+    for (c = 0; c < 3; c++) {
+      if (c < dither->error_channels)
+	err[c] -= (guint8) (*row >> 8 * c);
+      else
+	err[c] = 0;
+      cur_next_error[c] += FACTOR0 * err[c];
+      cur_next_error[c + 4] += FACTOR1 * err[c];
+      cur_next_error[c + 8] = FACTOR2 * err[c];
+      err[c] *= FACTOR_FRONT;
+    }
+    row++;
+    cur_error += 4;
+    cur_next_error += 4;
+  }
+}
+
+/* 8x8 Bayer matrix */
+static const guint8 bayer[8][8] = {
+  {  0, 32,  8, 40,  2, 34, 10, 42 },
+  { 48, 16, 56, 24, 50, 18, 58, 26 },
+  { 12, 44,  4, 36, 14, 46,  6, 38 },
+  { 60, 28, 52, 20, 62, 30, 54, 22 },
+  {  3, 35, 11, 43,  1, 33,  9, 41 },
+  { 51, 19, 59, 27, 49, 17, 57, 25 },
+  { 15, 47,  7, 39, 13, 45,  5, 37 },
+  { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+/* dithers n pixels of row y with the Bayer matrix, which is anchored to the
+ * full image so unchanged pixels always get the same index */
+static void
+gifenc_dither_span_ordered (const GifencDither *dither, guint8 *target, 
+    const guint32 *row, guint y, guint n)
+{
+  const GifencPalette *palette = dither->palette;
+  const guint8 *threshold = bayer[(dither->y + y) & 7];
+  guint8 color[3];
+  guint32 pixel;
+  int offset;
+  guint x, c;
+
+  for (x = 0; x < n; x++) {
+    offset = (threshold[(dither->x + x) & 7] >> 1) - 16;
+    for (c = 0; c < 3; c++) {
+      color[c] = CLAMP ((int) (guint8) (*row >> 8 * c) + offset, 0, 0xFF);
+    }
+    pixel = COLOR (color[2], color[1], color[0]);
+    target[x] = palette->lookup (palette->data, pixel, &pixel);
+    row++;
+  }
+}
+
+/* waits until the row above y has dithered its first n pixels */
+static inline void
+gifenc_dither_wait (const GifencDither *dither, guint y, guint n)
+{
+  if (dither->progress == NULL || y == 0)
+    return;
+
+  n = MIN (n, dither->width);
+  while ((guint) g_atomic_int_get (&dither->progress[y - 1]) < n)
+    g_thread_yield ();
+}
+
+/* makes unchanged pixels transparent and updates full and area */
+static void
+gifenc_dither_compare (const GifencDither *dither, guint8 *target, 
+    guint8 *full, guint x, guint y, guint n, cairo_rectangle_int_t *area)
+{
+  guint i;
+
+  for (i = x; i < x + n; i++) {
+    if (target[i] == full[i]) {
+      target[i] = dither->alpha;
+    } else {
+      area->x = MIN ((int) i, area->x);
+      area->y = MIN ((int) y, area->y);
+      area->width = MAX ((int) i, area->width);
+      area->height = MAX ((int) y, area->height);
+      full[i] = target[i];
+    }
+  }
+}
+
+/* Row y reads the errors row y - 1 diffused and writes the ones for row 
+ * y + 1 into the same memory, right behind where row y - 1 reads. So two
+ * error rows are enough even when neighbouring rows run on different 
+ * threads, as long as every row waits for the row above to be far enough
+ * ahead. */
+static void
+gifenc_dither_row (const GifencDither *dither, guint y, 
+    cairo_rectangle_int_t *area)
+{
+  const guint32 *row;
+  guint8 *target, *full;
+  gint *cur_error, *cur_next_error;
+  gint err[4] = { 0, 0, 0, 0 };
+  guint x, n;
+
+  row = (const guint32 *) (dither->data + y * dither->rowstride);
+  target = dither->target + y * dither->target_rowstride;
+  full = dither->full ? dither->full + y * dither->full_rowstride : NULL;
+  if (dither->ordered) {
+    gifenc_dither_span_ordered (dither, target, row, y, dither->width);
+    if (full)
+      gifenc_dither_compare (dither, target, full, 0, y, dither->width, area);
+    return;
+  }
+
+  cur_error = dither->errors + (y % 2) * dither->error_rowstride + 4;
+  cur_next_error = dither->errors + ((y + 1) % 2) * dither->error_rowstride;
+
+  /* row y - 1 reads the first two pixels when it starts */
+  gifenc_dither_wait (dither, y, 1);
+  memset (cur_next_error, 0, sizeof (gint) * 8);
+  for (x = 0; x < dither->width; x += n) {
+    n = MIN (GIFENC_DITHER_SPAN, dither->width - x);
+    /* pixel x needs the errors diffused by pixel x + 1 of the row above */
+    gifenc_dither_wait (dither, y, x + n + 1);
+    gifenc_dither_span (dither, target + x, row + x, cur_error + 4 * x, 
+	cur_next_error + 4 * x, err, n);
+    if (full)
+      gifenc_dither_compare (dither, target, full, x, y, n, area);
+    if (dither->progress)
+      g_atomic_int_set (&dither->progress[y], x + n);
+  }
+}
+
+/* dithers rows until none are left */
+static void
+gifenc_dither_rows (GifencDither *dither, cairo_rectangle_int_t *area)
+{
+  gint y;
+
+  while ((y = g_atomic_int_add (&dither->next_row, 1)) < (gint) dither->height)
+    gifenc_dither_row (dither, y, area);
+}
+
+static void
+gifenc_dither_merge_area (GifencDither *dither, const cairo_rectangle_int_t *area)
+{
+  dither->area.x = MIN (area->x, dither->area.x);
+  dither->area.y = MIN (area->y, dither->area.y);
+  dither->area.width = MAX (area->width, dither->area.width);
+  dither->area.height = MAX (area->height, dither->area.height);
+}
+
+static void
+gifenc_dither_job_run (gpointer data, gpointer enc_ptr)
+{
+  Gifenc *enc = enc_ptr;
+  GifencDither *dither = data;
+  cairo_rectangle_int_t area = { dither->width, dither->height, 0, 0 };
+
+  gifenc_dither_rows (dither, &area);
+
+  g_mutex_lock (&enc->dither_mutex);
+  gifenc_dither_merge_area (dither, &area);
+  dither->pending--;
+  /* other images may be dithered at the same time */
+  if (dither->pending == 0)
+    g_cond_broadcast (&enc->dither_cond);
+  g_mutex_unlock (&enc->dither_mutex);
+}
+
+/* Dithers all rows and returns the area of changed pixels as x, y, right and
+ * bottom. If enc is given, rows are dithered on its threads in parallel.
+ * The rows a thread takes are always just below the ones that are in 
+ * progress already, so dithering finishes even if the pool is busy. 
+ * Scratch memory is taken from context if it is big enough. */
+static void
+gifenc_dither (Gifenc *enc, GifencDitherContext *context, GifencDither *dither)
+{
+  cairo_rectangle_int_t area = { dither->width, dither->height, 0, 0 };
+  gboolean use_context;
+  guint i, n_threads;
+
+  if (enc && enc->dither_pool && dither->height > 1 &&
+      (guint64) dither->width * dither->height >= 2 * GIFENC_STRIP_PIXELS)
+    n_threads = MIN (enc->n_threads, dither->height);
+  else
+    n_threads = 1;
+
+  dither->area = area;
+  dither->next_row = 0;
+  use_context = context && dither->width <= context->max_width && 
+      dither->height <= context->max_height;
+  if (dither->ordered) {
+    /* rows don't depend on each other, so they need no scratch memory */
+    dither->errors = NULL;
+    dither->progress = NULL;
+  } else if (use_context) {
+    dither->errors = context->errors;
+    dither->error_rowstride = context->error_rowstride;
+    /* the first row reads the errors of a row above it, which must be 0,
+     * the other rows are written before they are read */
+    memset (dither->errors, 0,
+	sizeof (gint) * GIFENC_DITHER_ERROR_ROW (dither->width));
+    dither->progress = n_threads > 1 ? context->progress : NULL;
+  } else {
+    GIFENC_COUNT_ALLOCATION ();
+    dither->error_rowstride = GIFENC_DITHER_ERROR_ROW (dither->width);
+    dither->errors = g_new0 (gint, 2 * dither->error_rowstride);
+    dither->progress = n_threads > 1 ? g_new (gint, dither->height) : NULL;
+  }
+
+  if (dither->progress)
+    memset (dither->progress, 0, sizeof (gint) * dither->height);
+  if (n_threads > 1) {
+    dither->pending = n_threads - 1;
+    for (i = 1; i < n_threads; i++) {
+      g_thread_pool_push (enc->dither_pool, dither, NULL);
+    }
+  }
+  gifenc_dither_rows (dither, &area);
+  if (n_threads > 1) {
+    g_mutex_lock (&enc->dither_mutex);
+    while (dither->pending > 0)
+      g_cond_wait (&enc->dither_cond, &enc->dither_mutex);
+    g_mutex_unlock (&enc->dither_mutex);
+  }
+  gifenc_dither_merge_area (dither, &area);
+
+  if (!use_context) {
+    g_free (dither->errors);
+    g_free (dither->progress);
+  }
+}
+
+static void
+gifenc_dither_rgb_internal (Gifenc *enc, GifencDitherContext *context, 
+    guint8* target, 
+    guint target_rowstride, const GifencPalette *palette, const guint8 *data, 
+    guint width, guint height, guint rowstride)
+{
+  GifencDither dither = { 0, };
+
+  dither.palette = palette;
+  dither.target = target;
+  dither.target_rowstride = target_rowstride;
+  dither.data = data;
+  dither.rowstride = rowstride;
+  dither.width = width;
+  dither.height = height;
+  dither.error_channels = 3;
+  gifenc_dither (enc, context, &dither);
+}
+
+/* turns the changed area into a rectangle, returns FALSE if it's empty */
+static gboolean
+gifenc_dither_get_area (GifencDither *dither, cairo_rectangle_int_t *rect_out)
+{
+  cairo_rectangle_int_t *area = &dither->area;
+
+  if (area->width < area->x || area->height < area->y)
+    return FALSE;
+
+  if (rect_out) {
+    area->width = area->width - area->x + 1;
+    area->height = area->height - area->y + 1;
+    *rect_out = *area;
+  }
+  return TRUE;
+}
+
+static gboolean
+gifenc_dither_rgb_with_full_image_internal (Gifenc *enc, 
+    GifencDitherContext *context, guint8 *target, guint target_rowstride, guint8 *full, guint full_rowstride,
+    const GifencPalette *palette, const guint8 *data, guint width, 
+    guint height, guint rowstride, cairo_rectangle_int_t *rect_out)
+{
+  GifencDither dither = { 0, };
+
+  dither.palette = palette;
+  dither.target = target;
+  dither.target_rowstride = target_rowstride;
+  dither.full = full;
+  dither.full_rowstride = full_rowstride;
+  dither.alpha = gifenc_palette_get_alpha_index (palette);
+  dither.data = data;
+  dither.rowstride = rowstride;
+  dither.width = width;
+  dither.height = height;
+  /* historically, only the error of the first channel is diffused */
+  dither.error_channels = 1;
+  gifenc_dither (enc, context, &dither);
+
+  return gifenc_dither_get_area (&dither, rect_out);
+}
+
+static gboolean
+gifenc_dither_rgb_ordered_with_full_image_internal (Gifenc *enc, 
+    GifencDitherContext *context, guint8 *target, guint target_rowstride, 
+    guint8 *full, guint full_rowstride, const GifencPalette *palette, 
+    const guint8 *data, guint width, guint height, guint rowstride, 
+    guint x, guint y, cairo_rectangle_int_t *rect_out)
+{
+  GifencDither dither = { 0, };
+
+  dither.palette = palette;
+  dither.target = target;
+  dither.target_rowstride = target_rowstride;
+  dither.full = full;
+  dither.full_rowstride = full_rowstride;
+  dither.alpha = gifenc_palette_get_alpha_index (palette);
+  dither.data = data;
+  dither.rowstride = rowstride;
+  dither.width = width;
+  dither.height = height;
+  dither.ordered = TRUE;
+  dither.x = x;
+  dither.y = y;
+  gifenc_dither (enc, context, &dither);
+
+  return gifenc_dither_get_area (&dither, rect_out);
+}
+
 void
 gifenc_dither_rgb (guint8* target, guint target_rowstride, 
     const GifencPalette *palette, const guint8 *data, guint width, guint height, 
     guint rowstride)
 {
-  guint x, y, c;
-  gint *this_error, *next_error;
-  guint8 this[3];
-  gint err[3] = { 0, 0, 0 };
-  guint32 pixel;
-  
   g_return_if_fail (palette != NULL);
 
-  this_error = g_new0 (gint, (width + 2) * 3);
-  next_error = g_new (gint, (width + 2) * 3);
-  for (y = 0; y < height; y++) {
-    const guint32 *row = (const guint32 *) data;
-    gint *cur_error = this_error + 3;
-    gint *cur_next_error = next_error;
-    err[0] = err[1] = err[2] = 0;
-    memset (cur_next_error, 0, sizeof (gint) * 6);
-    for (x = 0; x < width; x++) {
-      //g_print ("%dx%d  %2X%2X%2X  %2d %2d %2d", x, y, row[0], row[1], row[2],
-      //    (err[0] + cur_error[0]) >> 8, (err[1] + cur_error[1]) >> 8,
-      //    (err[2] + cur_error[2]) >> 8);
-      for (c = 0; c < 3; c++) {
-	err[c] = ((err[c] + cur_error[c]) >> 8) + (guint8) (*row >> 8 * c);
-	this[c] = err[c] = CLAMP (err[c], 0, 0xFF);
-      }
-      pixel = COLOR (err[2], err[1], err[0]);
-      //g_print ("  %2X%2X%2X =>", this[0], this[1], this[2]);
-      target[x] = palette->lookup (palette->data, pixel, &pixel);
-      //g_print (" %2X%2X%2X (%u) %p\n", this[0], this[1], this[2], (guint) target[x], target + x);
-      for (c = 0; c < 3; c++) {
-	this[c] = *row >> 8 * c;
-	err[c] -= this[c];
-	cur_next_error[c] += FACTOR0 * err[c];
-	cur_next_error[c + 3] += FACTOR1 * err[c];
-	cur_next_error[c + 6] = FACTOR2 * err[c];
-	err[c] *= FACTOR_FRONT;
-      }
-      row++;
-      cur_error += 3;
-      cur_next_error += 3;
-    }
-    data += rowstride;
-    cur_error = this_error;
-    this_error = next_error;
-    next_error = cur_error;
-    target += target_rowstride;
-  }
-  g_free (this_error);
-  g_free (next_error);
+  gifenc_dither_rgb_internal (NULL, NULL, target, target_rowstride, palette, data,
+      width, height, rowstride);
 }
 
 gboolean
@@ -532,79 +1866,197 @@ gifenc_dither_rgb_with_full_image (guint8 *target, guint target_rowstride,
     const GifencPalette *palette, const guint8 *data, guint width, guint height, 
     guint rowstride, cairo_rectangle_int_t *rect_out)
 {
-  int x, y, c;
-  gint *this_error, *next_error;
-  guint8 this[3], alpha;
-  gint err[3] = { 0, 0, 0 };
-  guint32 pixel;
-  cairo_rectangle_int_t area = { width, height, 0, 0 };
-  
   g_return_val_if_fail (palette != NULL, FALSE);
   g_return_val_if_fail (palette->alpha, FALSE);
-  alpha = gifenc_palette_get_alpha_index (palette);
-
-  this_error = g_new0 (gint, (width + 2) * 3);
-  next_error = g_new (gint, (width + 2) * 3);
-  for (y = 0; y < (int) height; y++) {
-    const guint32 *row = (const guint32 *) data;
-    gint *cur_error = this_error + 3;
-    gint *cur_next_error = next_error;
-    err[0] = err[1] = err[2] = 0;
-    memset (cur_next_error, 0, sizeof (gint) * 6);
-    for (x = 0; x < (int) width; x++) {
-      //g_print ("%dx%d  %2X%2X%2X  %2d %2d %2d", x, y, row[0], row[1], row[2],
-      //    (err[0] + cur_error[0]) >> 8, (err[1] + cur_error[1]) >> 8,
-      //    (err[2] + cur_error[2]) >> 8);
-      for (c = 0; c < 3; c++) {
-	err[c] = ((err[c] + cur_error[c]) >> 8) + (guint8) (*row >> 8 * c);
-	this[c] = err[c] = CLAMP (err[c], 0, 0xFF);
-      }
-      //g_print ("  %2X%2X%2X =>", this[0], this[1], this[2]);
-      pixel = COLOR (this[2], this[1], this[0]);
-      target[x] = palette->lookup (palette->data, pixel, &pixel);
-      if (target[x] == full[x]) {
-	target[x] = alpha;
-      } else {
-	area.x = MIN (x, area.x);
-	area.y = MIN (y, area.y);
-	area.width = MAX (x, area.width);
-	area.height = MAX (y, area.height);
-	full[x] = target[x];
-      }
-      //g_print (" %2X%2X%2X (%u) %p\n", this[0], this[1], this[2], (guint) target[x], target + x);
-      for (c = 0; c < 3; c++) {
-	this[0] = *row >> 8 * c;
-	err[c] -= this[c];
-	cur_next_error[c] += FACTOR0 * err[c];
-	cur_next_error[c + 3] += FACTOR1 * err[c];
-	cur_next_error[c + 6] = FACTOR2 * err[c];
-	err[c] *= FACTOR_FRONT;
-      }
-      row++;
-      cur_error += 3;
-      cur_next_error += 3;
-    }
-    data += rowstride;
-    cur_error = this_error;
-    this_error = next_error;
-    next_error = cur_error;
-    target += target_rowstride;
-    full += full_rowstride;
-  }
-  g_free (this_error);
-  g_free (next_error);
 
-  if (area.width < area.x || area.height < area.y) {
-    return FALSE;
-  } else {
-    if (rect_out) {
-      area.width = area.width - area.x + 1;
-      area.height = area.height - area.y + 1;
-      //g_print ("image was %d %d, relevant is %d %d %d %d\n", width, height,
-      //    area.x, area.y, area.width, area.height);
-      *rect_out = area;
-    }
-    return TRUE;
-  }
+  return gifenc_dither_rgb_with_full_image_internal (NULL, NULL, target, 
+      target_rowstride, full, full_rowstride, palette, data, width, height, 
+      rowstride, rect_out);
+}
+
+/**
+ * gifenc_dither_rgb_threaded:
+ * @enc: encoder whose threads to use
+ * @context: %NULL or scratch memory to use
+ *
+ * Works like gifenc_dither_rgb(), but large images are dithered on up to
+ * as many threads as set with gifenc_set_n_threads(). Every row trails the
+ * row above it, so the result is the same.
+ **/
+void
+gifenc_dither_rgb_threaded (Gifenc *enc, GifencDitherContext *context, 
+    guint8* target, 
+    guint target_rowstride, const GifencPalette *palette, const guint8 *data, 
+    guint width, guint height, guint rowstride)
+{
+  g_return_if_fail (enc != NULL);
+  g_return_if_fail (palette != NULL);
+
+  gifenc_dither_rgb_internal (enc, context, target, target_rowstride, palette, data,
+      width, height, rowstride);
+}
+
+/**
+ * gifenc_dither_rgb_with_full_image_threaded:
+ * @enc: encoder whose threads to use
+ * @context: %NULL or scratch memory to use
+ *
+ * Works like gifenc_dither_rgb_with_full_image(), but large images are 
+ * dithered on up to as many threads as set with gifenc_set_n_threads().
+ **/
+gboolean
+gifenc_dither_rgb_with_full_image_threaded (Gifenc *enc, 
+    GifencDitherContext *context, guint8 *target, guint target_rowstride, 
+    guint8 *full, guint full_rowstride,
+    const GifencPalette *palette, const guint8 *data, guint width, guint height, 
+    guint rowstride, cairo_rectangle_int_t *rect_out)
+{
+  g_return_val_if_fail (enc != NULL, FALSE);
+  g_return_val_if_fail (palette != NULL, FALSE);
+  g_return_val_if_fail (palette->alpha, FALSE);
+
+  return gifenc_dither_rgb_with_full_image_internal (enc, context, target, 
+      target_rowstride, full, full_rowstride, palette, data, width, height, 
+      rowstride, rect_out);
+}
+
+/**
+ * gifenc_dither_context_new:
+ * @max_width: maximum width of images to dither
+ * @max_height: maximum height of images to dither
+ *
+ * Creates scratch memory for the dithering functions, so they don't need
+ * to allocate on every call. A context can only be used by one call at a
+ * time. Bigger images can still be dithered with it, but need to allocate.
+ *
+ * Returns: a new context, free it with gifenc_dither_context_free()
+ **/
+GifencDitherContext *
+gifenc_dither_context_new (guint max_width, guint max_height)
+{
+  GifencDitherContext *context;
+  gsize size;
+
+  context = g_slice_new0 (GifencDitherContext);
+  context->max_width = max_width;
+  context->max_height = max_height;
+  /* start error rows at cache lines */
+  context->error_rowstride = GIFENC_ALIGN (GIFENC_DITHER_ERROR_ROW (max_width), 
+      GIFENC_CACHE_LINE / sizeof (gint));
+  size = sizeof (gint) * (2 * context->error_rowstride + max_height);
+  context->memory = g_malloc (size + GIFENC_CACHE_LINE);
+  context->errors = (gint *) GIFENC_ALIGN ((gsize) context->memory, GIFENC_CACHE_LINE);
+  context->progress = context->errors + 2 * context->error_rowstride;
+
+  return context;
+}
+
+void
+gifenc_dither_context_free (GifencDitherContext *context)
+{
+  g_return_if_fail (context != NULL);
+
+  g_free (context->memory);
+  g_slice_free (GifencDitherContext, context);
+}
+
+/**
+ * gifenc_dither_get_n_allocations:
+ *
+ * Counts how often the dithering functions allocated memory. This is only
+ * done when compiled with GIFENC_DEBUG, otherwise 0 is returned.
+ *
+ * Returns: the number of allocations so far
+ **/
+guint
+gifenc_dither_get_n_allocations (void)
+{
+#ifdef GIFENC_DEBUG
+  return g_atomic_int_get (&gifenc_dither_n_allocations);
+#else
+  return 0;
+#endif
+}
+
+/**
+ * gifenc_dither_rgb_ordered_with_full_image:
+ * @x: x coordinate of @data in the full image
+ * @y: y coordinate of @data in the full image
+ *
+ * Works like gifenc_dither_rgb_with_full_image(), but uses a Bayer matrix 
+ * anchored to the full image instead of error diffusion. So every pixel is
+ * dithered on its own and unchanged pixels always map to the same index.
+ **/
+gboolean
+gifenc_dither_rgb_ordered_with_full_image (guint8 *target, guint target_rowstride, 
+    guint8 *full, guint full_rowstride,
+    const GifencPalette *palette, const guint8 *data, guint width, guint height, 
+    guint rowstride, guint x, guint y, cairo_rectangle_int_t *rect_out)
+{
+  g_return_val_if_fail (palette != NULL, FALSE);
+  g_return_val_if_fail (palette->alpha, FALSE);
+
+  return gifenc_dither_rgb_ordered_with_full_image_internal (NULL, NULL, 
+      target, target_rowstride, full, full_rowstride, palette, data, width, 
+      height, rowstride, x, y, rect_out);
+}
+
+/**
+ * gifenc_dither_rgb_ordered_with_full_image_threaded:
+ * @enc: encoder whose threads to use
+ * @context: %NULL or scratch memory to use
+ *
+ * Works like gifenc_dither_rgb_ordered_with_full_image(), but large images 
+ * are dithered on up to as many threads as set with gifenc_set_n_threads().
+ * Rows don't wait for each other, as every pixel is dithered on its own.
+ **/
+gboolean
+gifenc_dither_rgb_ordered_with_full_image_threaded (Gifenc *enc, 
+    GifencDitherContext *context, guint8 *target, guint target_rowstride, 
+    guint8 *full, guint full_rowstride,
+    const GifencPalette *palette, const guint8 *data, guint width, guint height, 
+    guint rowstride, guint x, guint y, cairo_rectangle_int_t *rect_out)
+{
+  g_return_val_if_fail (enc != NULL, FALSE);
+  g_return_val_if_fail (palette != NULL, FALSE);
+  g_return_val_if_fail (palette->alpha, FALSE);
+
+  return gifenc_dither_rgb_ordered_with_full_image_internal (enc, context, 
+      target, target_rowstride, full, full_rowstride, palette, data, width, 
+      height, rowstride, x, y, rect_out);
+}
+
+/**
+ * gifenc_dither_rgb_ordered_threaded:
+ * @enc: encoder whose threads to use
+ * @context: %NULL or scratch memory to use
+ * @x: x coordinate of @data in the full image
+ * @y: y coordinate of @data in the full image
+ *
+ * Works like gifenc_dither_rgb_threaded(), but uses a Bayer matrix anchored
+ * to the full image instead of error diffusion.
+ **/
+void
+gifenc_dither_rgb_ordered_threaded (Gifenc *enc, GifencDitherContext *context,
+    guint8 *target, guint target_rowstride, const GifencPalette *palette, 
+    const guint8 *data, guint width, guint height, guint rowstride, 
+    guint x, guint y)
+{
+  GifencDither dither = { 0, };
+
+  g_return_if_fail (enc != NULL);
+  g_return_if_fail (palette != NULL);
+
+  dither.palette = palette;
+  dither.target = target;
+  dither.target_rowstride = target_rowstride;
+  dither.data = data;
+  dither.rowstride = rowstride;
+  dither.width = width;
+  dither.height = height;
+  dither.ordered = TRUE;
+  dither.x = x;
+  dither.y = y;
+  gifenc_dither (enc, context, &dither);
 }
 
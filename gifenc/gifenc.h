@@ -26,15 +26,40 @@
 typedef struct _GifencPalette GifencPalette;
 typedef struct _GifencColor GifencColor;
 typedef struct _Gifenc Gifenc;
+typedef struct _GifencStrip GifencStrip;
+typedef struct _GifencDitherContext GifencDitherContext;
+typedef struct _GifencHistogram GifencHistogram;
 
 typedef gboolean (* GifencWriteFunc) (gpointer closure, const guchar *data, gsize len, GError **error);
 
+/* marks unused entries of GifencHistogram */
+#define GIFENC_HISTOGRAM_EMPTY 0xFFFFFFFF
+
+/* images with at least twice this many pixels are compressed in strips */
+#define GIFENC_STRIP_PIXELS (1 << 18)
+#define GIFENC_MAX_STRIPS 16
+
 typedef enum {
   GIFENC_STATE_NEW = 0,
   GIFENC_STATE_INITIALIZED,
   GIFENC_STATE_CLOSED,
 } GifencState;
 
+typedef enum {
+  GIFENC_DITHER_FLOYD_STEINBERG,	/* error diffusion */
+  GIFENC_DITHER_ORDERED		/* Bayer matrix, unchanged pixels stay the same */
+} GifencDitherMethod;
+
+typedef enum {
+  GIFENC_LZW_HASH,	/* open addressing hash table, small memory footprint */
+  GIFENC_LZW_TABLE	/* direct-indexed code table, no probing */
+} GifencLzwEngine;
+
+typedef enum {
+  GIFENC_QUANTIZER_OCTREE,	/* adaptive octree, good for few distinct colors */
+  GIFENC_QUANTIZER_WU		/* variance minimization on RGB555, fixed memory */
+} GifencQuantizer;
+
 struct _GifencPalette {
   gboolean	alpha;
   guint32 *	colors;
@@ -47,6 +72,28 @@ struct _GifencPalette {
   void		(* free)	(gpointer		data);
 };
 
+struct _GifencHistogram {
+  guint32 *	colors;		/* hash table of colors, GIFENC_HISTOGRAM_EMPTY if unused */
+  guint64 *	counts;		/* number of pixels for every color */
+  guint		size;		/* size of the hash table, a power of 2 */
+  guint		n_colors;	/* number of different colors */
+};
+
+struct _GifencDitherContext {
+  guint		max_width;	/* maximum width of images */
+  guint		max_height;	/* maximum height of images */
+  gpointer	memory;		/* allocated memory */
+  gint *	errors;		/* two error rows, cache line aligned */
+  guint		error_rowstride; /* ints from one error row to the next */
+  gint *	progress;	/* max_height row progress counters */
+};
+
+struct _GifencStrip {
+  guint8 *		data;		/* compressed codes, not split into sub-blocks */
+  gsize			size;		/* allocated size of data */
+  gsize			n_bits;		/* number of bits used in data */
+};
+
 struct _Gifenc {
   /* error checking */
   GifencState           state;
@@ -55,9 +102,28 @@ struct _Gifenc {
   GifencWriteFunc       write_func;
   gpointer              write_data;
   GDestroyNotify        write_destroy;
-  GByteArray *          buffer;
+  guint8 *              arena;          /* preallocated memory to write to */
+  gsize                 arena_size;     /* size of arena */
+  guint8 *              data;           /* memory currently written to */
+  gsize                 len;            /* bytes written to data */
+  gsize                 size;           /* bytes available in data */
   guint			bits;
   guint			n_bits;
+  GifencLzwEngine	lzw_engine;
+  GAsyncQueue *		lzw_tables;	/* unused code tables for GIFENC_LZW_TABLE */
+  guint			lossy;		/* maximum color error when matching strings */
+  GifencQuantizer	quantizer;	/* algorithm to create palettes with */
+
+  /* parallel compression */
+  guint			n_threads;
+  GThreadPool *		strip_pool;	/* NULL or pool compressing strips */
+  GifencStrip *		strips[GIFENC_MAX_STRIPS];
+  GMutex		strip_mutex;
+  GCond			strip_cond;
+  guint			strips_pending;	/* strips still compressed by the pool */
+  GThreadPool *		dither_pool;	/* NULL or pool dithering rows */
+  GMutex		dither_mutex;
+  GCond			dither_cond;
   
   /* image */
   guint		  	width;
@@ -72,6 +138,14 @@ Gifenc *        gifenc_new              (guint                  width,
                                          gpointer               write_data,
                                          GDestroyNotify         write_destroy);
 gboolean        gifenc_free             (Gifenc *		enc);
+void		gifenc_set_lzw_engine	(Gifenc *		enc,
+					 GifencLzwEngine	engine);
+void		gifenc_set_quantizer	(Gifenc *		enc,
+					 GifencQuantizer	quantizer);
+void		gifenc_set_lossy	(Gifenc *		enc,
+					 guint			max_error);
+void		gifenc_set_n_threads	(Gifenc *		enc,
+					 guint			n_threads);
 					 
 gboolean        gifenc_initialize	(Gifenc *		enc,
 					 GifencPalette *	palette,
@@ -86,11 +160,54 @@ gboolean        gifenc_add_image	(Gifenc *		enc,
 					 guint8 *		data,
 					 guint			rowstride,
                                          GError **		error);
+gboolean	gifenc_add_image_with_previous
+					(Gifenc *		enc,
+					 guint			x,
+					 guint			y,
+					 guint			width,
+					 guint			height,
+					 guint			display_millis,
+					 guint8 *		data,
+					 guint			rowstride,
+					 guint8 *		previous,
+					 guint			previous_rowstride,
+                                         GError **		error);
+gboolean	gifenc_add_image_with_palette
+					(Gifenc *		enc,
+					 guint			x,
+					 guint			y,
+					 guint			width,
+					 guint			height,
+					 guint			display_millis,
+					 GifencPalette *	palette,
+					 guint8 *		data,
+					 guint			rowstride,
+                                         GError **		error);
+gboolean	gifenc_add_image_strips	(Gifenc *		enc,
+					 guint			x,
+					 guint			y,
+					 guint			width,
+					 guint			height,
+					 guint			display_millis,
+					 GifencStrip **		strips,
+					 guint			n_strips,
+                                         GError **		error);
 gboolean        gifenc_close            (Gifenc *       	gifenc,
                                          GError **      	error);
 guint           gifenc_get_width        (Gifenc *               gifenc);
 guint           gifenc_get_height       (Gifenc *               gifenc);
 
+GifencStrip *	gifenc_strip_new	(void);
+void		gifenc_strip_free	(GifencStrip *		strip);
+void		gifenc_strip_compress	(Gifenc *		enc,
+					 GifencStrip *		strip,
+					 guint8 *		data,
+					 guint			width,
+					 guint			height,
+					 guint			rowstride,
+					 gboolean		first,
+					 gboolean		last);
+
 void		gifenc_dither_rgb	(guint8 *		target,
 					 guint			target_rowstride,
 					 const GifencPalette *	palette,
@@ -109,6 +226,77 @@ gboolean	gifenc_dither_rgb_with_full_image
 					 guint			 height,
 					 guint			 rowstride,
 					 cairo_rectangle_int_t * rect_out);
+GifencDitherContext *
+		gifenc_dither_context_new
+					(guint			 max_width,
+					 guint			 max_height);
+void		gifenc_dither_context_free
+					(GifencDitherContext *	 context);
+guint		gifenc_dither_get_n_allocations
+					(void);
+void		gifenc_dither_rgb_threaded
+					(Gifenc *		 enc,
+					 GifencDitherContext *	 context,
+					 guint8 *		 target,
+					 guint			 target_rowstride,
+					 const GifencPalette *	 palette,
+					 const guint8 *		 data,
+					 guint			 width,
+					 guint			 height,
+					 guint			 rowstride);
+gboolean	gifenc_dither_rgb_with_full_image_threaded
+					(Gifenc *		 enc,
+					 GifencDitherContext *	 context,
+					 guint8 *		 target,
+					 guint			 target_rowstride,
+					 guint8 *		 full,
+					 guint			 full_rowstride,
+					 const GifencPalette *	 palette,
+					 const guint8 *		 data,
+					 guint			 width,
+					 guint			 height,
+					 guint			 rowstride,
+					 cairo_rectangle_int_t * rect_out);
+gboolean	gifenc_dither_rgb_ordered_with_full_image
+					(guint8 *		 target,
+					 guint			 target_rowstride,
+					 guint8 *		 full,
+					 guint			 full_rowstride,
+					 const GifencPalette *	 palette,
+					 const guint8 *		 data,
+					 guint			 width,
+					 guint			 height,
+					 guint			 rowstride,
+					 guint			 x,
+					 guint			 y,
+					 cairo_rectangle_int_t * rect_out);
+gboolean	gifenc_dither_rgb_ordered_with_full_image_threaded
+					(Gifenc *		 enc,
+					 GifencDitherContext *	 context,
+					 guint8 *		 target,
+					 guint			 target_rowstride,
+					 guint8 *		 full,
+					 guint			 full_rowstride,
+					 const GifencPalette *	 palette,
+					 const guint8 *		 data,
+					 guint			 width,
+					 guint			 height,
+					 guint			 rowstride,
+					 guint			 x,
+					 guint			 y,
+					 cairo_rectangle_int_t * rect_out);
+void		gifenc_dither_rgb_ordered_threaded
+					(Gifenc *		 enc,
+					 GifencDitherContext *	 context,
+					 guint8 *		 target,
+					 guint			 target_rowstride,
+					 const GifencPalette *	 palette,
+					 const guint8 *		 data,
+					 guint			 width,
+					 guint			 height,
+					 guint			 rowstride,
+					 guint			 x,
+					 guint			 y);
 
 /* from quantize.c */
 void		gifenc_palette_free	(GifencPalette *	palette);
@@ -119,6 +307,22 @@ GifencPalette *	gifenc_quantize_image	(const guint8 *		data,
 					 guint			rowstride, 
 					 gboolean		alpha,
 					 guint			max_colors);
+GifencHistogram *gifenc_histogram_new	(void);
+void		gifenc_histogram_free	(GifencHistogram *	histogram);
+void		gifenc_histogram_add_image
+					(GifencHistogram *	histogram,
+					 const guint8 *		data,
+					 guint			width, 
+					 guint			height,
+					 guint			rowstride);
+void		gifenc_histogram_merge	(GifencHistogram *	histogram,
+					 const GifencHistogram *other);
+GifencPalette *	gifenc_quantize_histogram
+					(const GifencHistogram *histogram,
+					 GifencQuantizer	quantizer,
+					 gboolean		alpha,
+					 guint			max_colors,
+					 gboolean		complete);
 guint		gifenc_palette_get_alpha_index
 					(const GifencPalette *	palette);
 guint		gifenc_palette_get_num_colors
@@ -0,0 +1,183 @@
+/* simple gif encoder
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Compares the quantizers on a single frame: how long building the palette
+ * and looking up colors takes, how far the colors end up from the image
+ * and how big the dithered frame gets when encoded. */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <gtk/gtk.h>
+#include "gifenc.h"
+
+static int runs = 10;
+
+static GOptionEntry entries[] =
+{
+  { "runs", 'n', 0, G_OPTION_ARG_INT, &runs, "Build every palette N times (default: 10)", "N" },
+  { NULL }
+};
+
+static gboolean
+count_bytes (gpointer closure, const guchar *data, gsize len, GError **error)
+{
+  gsize *size = closure;
+
+  *size += len;
+  return TRUE;
+}
+
+/* returns the pixels of the image in the xRGB format gifenc takes */
+static guint32 *
+load_image (const char *filename, guint *width, guint *height, GError **error)
+{
+  GdkPixbuf *pixbuf;
+  const guint8 *pixels, *p;
+  guint32 *data;
+  guint x, y, n_channels, rowstride;
+
+  pixbuf = gdk_pixbuf_new_from_file (filename, error);
+  if (pixbuf == NULL)
+    return NULL;
+
+  *width = gdk_pixbuf_get_width (pixbuf);
+  *height = gdk_pixbuf_get_height (pixbuf);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  data = g_new (guint32, *width * *height);
+  for (y = 0; y < *height; y++) {
+    for (x = 0; x < *width; x++) {
+      p = pixels + y * rowstride + x * n_channels;
+      data[y * *width + x] = (p[0] << 16) | (p[1] << 8) | p[2];
+    }
+  }
+  g_object_unref (pixbuf);
+
+  return data;
+}
+
+static void
+benchmark (const char *name, GifencQuantizer quantizer,
+    const GifencHistogram *histogram, const guint32 *data, guint width,
+    guint height)
+{
+  GifencPalette *palette;
+  GTimer *timer;
+  Gifenc *enc;
+  guint8 *image;
+  guint32 looked_up;
+  gdouble build, lookup, encode, error;
+  gsize i, n_pixels, size;
+  int r, g, b;
+
+  timer = g_timer_new ();
+  palette = NULL;
+  for (i = 0; i < (gsize) runs; i++) {
+    if (palette)
+      gifenc_palette_free (palette);
+    /* like the first frame of a recording, which needs room for later
+     * colors */
+    palette = gifenc_quantize_histogram (histogram, quantizer, TRUE, 255, FALSE);
+  }
+  build = g_timer_elapsed (timer, NULL) / runs;
+
+  n_pixels = (gsize) width * height;
+  g_timer_start (timer);
+  for (i = 0; i < n_pixels; i++) {
+    palette->lookup (palette->data, data[i], &looked_up);
+  }
+  lookup = g_timer_elapsed (timer, NULL) / n_pixels;
+
+  error = 0;
+  for (i = 0; i < n_pixels; i++) {
+    palette->lookup (palette->data, data[i], &looked_up);
+    r = (int) (data[i] >> 16 & 0xFF) - (int) (looked_up >> 16 & 0xFF);
+    g = (int) (data[i] >> 8 & 0xFF) - (int) (looked_up >> 8 & 0xFF);
+    b = (int) (data[i] & 0xFF) - (int) (looked_up & 0xFF);
+    error += r * r + g * g + b * b;
+  }
+  error /= n_pixels;
+
+  size = 0;
+  image = g_malloc (n_pixels);
+  enc = gifenc_new (width, height, count_bytes, &size, NULL);
+  g_timer_start (timer);
+  gifenc_dither_rgb (image, width, palette, (const guint8 *) data, width,
+      height, width * 4);
+  if (!gifenc_initialize (enc, palette, FALSE, NULL) ||
+      !gifenc_add_image (enc, 0, 0, width, height, 100, image, width, NULL) ||
+      !gifenc_close (enc, NULL))
+    g_assert_not_reached ();
+  encode = g_timer_elapsed (timer, NULL);
+
+  g_print ("%-8s %3u colors  build %8.3fms  lookup %5.2fns  error %7.2f  "
+      "encode %8.3fms  %9" G_GSIZE_FORMAT " bytes\n", name,
+      gifenc_palette_get_num_colors (palette), build * 1000, lookup * 1e9,
+      error, encode * 1000, size);
+
+  /* frees the palette */
+  gifenc_free (enc);
+  g_free (image);
+  g_timer_destroy (timer);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GifencHistogram *histogram;
+  GError *error = NULL;
+  guint32 *data;
+  guint width, height;
+
+  context = g_option_context_new ("IMAGE - compare the quantizers on IMAGE");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    return 1;
+  }
+  if (argc != 2 || runs < 1) {
+    g_printerr ("usage: %s [-n RUNS] IMAGE\n", g_get_prgname ());
+    return 1;
+  }
+
+  data = load_image (argv[1], &width, &height, &error);
+  if (data == NULL) {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    return 1;
+  }
+
+  histogram = gifenc_histogram_new ();
+  gifenc_histogram_add_image (histogram, (const guint8 *) data, width,
+      height, width * 4);
+  g_print ("%ux%u, %u colors\n", width, height, histogram->n_colors);
+
+  benchmark ("octree", GIFENC_QUANTIZER_OCTREE, histogram, data, width, height);
+  benchmark ("wu", GIFENC_QUANTIZER_WU, histogram, data, width, height);
+
+  gifenc_histogram_free (histogram);
+  g_free (data);
+  g_option_context_free (context);
+
+  return 0;
+}
@@ -100,6 +100,146 @@ gifenc_palette_get_simple (gboolean alpha)
   return palette;
 }
 
+/*** HISTOGRAM ***/
+
+#define HISTOGRAM_INITIAL_SIZE 4096
+/* the high half of the product mixes all bits of the color, so tables of
+ * any size get used evenly */
+#define HISTOGRAM_HASH(color, size) \
+  ((guint) (((guint64) (color) * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15)) >> 32) & ((size) - 1))
+
+GifencHistogram *
+gifenc_histogram_new (void)
+{
+  GifencHistogram *histogram;
+
+  histogram = g_slice_new (GifencHistogram);
+  histogram->size = HISTOGRAM_INITIAL_SIZE;
+  histogram->n_colors = 0;
+  histogram->colors = g_new (guint32, histogram->size);
+  memset (histogram->colors, 0xFF, sizeof (guint32) * histogram->size);
+  histogram->counts = g_new (guint64, histogram->size);
+
+  return histogram;
+}
+
+void
+gifenc_histogram_free (GifencHistogram *histogram)
+{
+  g_return_if_fail (histogram != NULL);
+
+  g_free (histogram->colors);
+  g_free (histogram->counts);
+  g_slice_free (GifencHistogram, histogram);
+}
+
+static void gifenc_histogram_add (GifencHistogram *histogram, guint32 color, 
+    guint64 count);
+
+/* keeps the table at most half full */
+static void
+gifenc_histogram_grow (GifencHistogram *histogram)
+{
+  guint32 *colors = histogram->colors;
+  guint64 *counts = histogram->counts;
+  guint i, size = histogram->size;
+
+  histogram->size *= 2;
+  histogram->n_colors = 0;
+  histogram->colors = g_new (guint32, histogram->size);
+  memset (histogram->colors, 0xFF, sizeof (guint32) * histogram->size);
+  histogram->counts = g_new (guint64, histogram->size);
+  for (i = 0; i < size; i++) {
+    if (colors[i] != GIFENC_HISTOGRAM_EMPTY)
+      gifenc_histogram_add (histogram, colors[i], counts[i]);
+  }
+  g_free (colors);
+  g_free (counts);
+}
+
+static void
+gifenc_histogram_add (GifencHistogram *histogram, guint32 color, guint64 count)
+{
+  guint i;
+
+  for (i = HISTOGRAM_HASH (color, histogram->size);; i = (i + 1) & (histogram->size - 1)) {
+    if (histogram->colors[i] == color) {
+      histogram->counts[i] += count;
+      return;
+    }
+    if (histogram->colors[i] == GIFENC_HISTOGRAM_EMPTY)
+      break;
+  }
+  histogram->colors[i] = color;
+  histogram->counts[i] = count;
+  histogram->n_colors++;
+  if (histogram->n_colors * 2 > histogram->size)
+    gifenc_histogram_grow (histogram);
+}
+
+/**
+ * gifenc_histogram_add_image:
+ * @histogram: the histogram
+ * @data: RGB image data in native endian 32bit words
+ * @width: width of the image
+ * @height: height of the image
+ * @rowstride: bytes from one row of @data to the next
+ *
+ * Counts the colors of the given image.
+ **/
+void
+gifenc_histogram_add_image (GifencHistogram *histogram, const guint8 *data,
+    guint width, guint height, guint rowstride)
+{
+  const guint32 *row;
+  guint32 color, last;
+  guint64 count;
+  guint x, y;
+
+  g_return_if_fail (histogram != NULL);
+
+  /* screen content has long runs of the same color */
+  last = 0;
+  count = 0;
+  for (y = 0; y < height; y++) {
+    row = (const guint32 *) data;
+    for (x = 0; x < width; x++) {
+      color = row[x] & 0xFFFFFF;
+      if (color != last && count) {
+	gifenc_histogram_add (histogram, last, count);
+	count = 0;
+      }
+      last = color;
+      count++;
+    }
+    data += rowstride;
+  }
+  if (count)
+    gifenc_histogram_add (histogram, last, count);
+}
+
+/**
+ * gifenc_histogram_merge:
+ * @histogram: the histogram to add to
+ * @other: the histogram to add
+ *
+ * Adds the colors counted in @other to @histogram, so histograms of parts
+ * of an image can be computed in parallel.
+ **/
+void
+gifenc_histogram_merge (GifencHistogram *histogram, const GifencHistogram *other)
+{
+  guint i;
+
+  g_return_if_fail (histogram != NULL);
+  g_return_if_fail (other != NULL);
+
+  for (i = 0; i < other->size; i++) {
+    if (other->colors[i] != GIFENC_HISTOGRAM_EMPTY)
+      gifenc_histogram_add (histogram, other->colors[i], other->counts[i]);
+  }
+}
+
 /*** OCTREE QUANTIZATION ***/
 
 /* maximum number of leaves before starting color reduction */
@@ -107,14 +247,19 @@ gifenc_palette_get_simple (gboolean alpha)
 /* maximum number of leaves before stopping a running color reduction */
 #define STOP_LEAVES (MAX_LEAVES >> 2)
 
+/* Nodes live in one array and refer to each other by index, so the tree 
+ * is compact and freed at once. Index 0 is the root, which is nobody's 
+ * child, so 0 means no child. The children of reduced nodes are reused,
+ * they are linked by their parent field. */
 typedef struct _GifencOctree GifencOctree;
 struct _GifencOctree {
-  GifencOctree *	children[8];	/* children nodes or NULL */
+  guint32		children[8];	/* indexes of children nodes or 0 */
+  guint32		parent;		/* index of parent node */
   guint			level;		/* how deep in tree are we? */
-  guint			red;		/* sum of all red pixels */
-  guint			green;		/* sum of green pixels */
-  guint			blue;		/* sum of blue pixels */
-  guint			count;		/* amount of pixels at this node */
+  guint64		red;		/* sum of all red pixels */
+  guint64		green;		/* sum of green pixels */
+  guint64		blue;		/* sum of blue pixels */
+  guint64		count;		/* amount of pixels at this node */
   guint32     		color;		/* representations (depending on value):
 					   -1: random non-leaf node 
 					   -2: root node
@@ -123,53 +268,60 @@ struct _GifencOctree {
   guint			id;		/* color index */
 };					  
 typedef struct {
-  GifencOctree *	tree;
-  GSList *		non_leaves;
+  GifencOctree *	nodes;		/* all nodes, the root is the first */
+  guint			n_nodes;	/* nodes handed out, reused ones included */
+  guint			size;		/* nodes allocated */
   guint			num_leaves;
+  guint32		free_nodes;	/* first node to reuse or 0 */
 } OctreeInfo;
 #define OCTREE_IS_LEAF(tree) ((tree)->color <= 0x1000000)
+#define OCTREE_NODE(info, i) (&(info)->nodes[i])
 
-static GifencOctree *
-gifenc_octree_new (void)
+static guint32
+gifenc_octree_new (OctreeInfo *info, guint32 parent, guint level)
 {
-  GifencOctree *ret = g_new0 (GifencOctree, 1);
+  GifencOctree *ret;
+  guint32 node;
 
-  ret->color = (guint) -1;
-  return ret;
-}
-
-static void
-gifenc_octree_free (gpointer data)
-{
-  GifencOctree *tree = data;
-  guint i;
-  
-  for (i = 0; i < 8; i++) {
-    if (tree->children[i])
-      gifenc_octree_free (tree->children[i]);
+  if (info->free_nodes) {
+    node = info->free_nodes;
+    info->free_nodes = OCTREE_NODE (info, node)->parent;
+  } else {
+    if (info->n_nodes == info->size) {
+      info->size = MAX (info->size * 2, 1024);
+      info->nodes = g_renew (GifencOctree, info->nodes, info->size);
+    }
+    node = info->n_nodes++;
   }
-  g_free (tree);
+  ret = OCTREE_NODE (info, node);
+  memset (ret, 0, sizeof (GifencOctree));
+  ret->parent = parent;
+  ret->level = level;
+  ret->color = (guint) -1;
+  return node;
 }
 
 #if 0
 #define PRINT_NON_LEAVES 1
 static void
-gifenc_octree_print (GifencOctree *tree, guint flags)
+gifenc_octree_print (OctreeInfo *info, guint32 node, guint flags)
 {
+  GifencOctree *tree = OCTREE_NODE (info, node);
 #define FLAG_SET(flag) (flags & (flag))
   if (OCTREE_IS_LEAF (tree)) {
-    g_print ("%*s %6d %2X-%2X-%2X\n", tree->level * 2, "", tree->count, 
-	tree->red / tree->count, tree->green / tree->count, tree->blue / tree->count);
+    g_print ("%*s %6" G_GUINT64_FORMAT " %2X-%2X-%2X\n", tree->level * 2, "", tree->count, 
+	(guint) (tree->red / tree->count), (guint) (tree->green / tree->count),
+	(guint) (tree->blue / tree->count));
   } else {
     guint i;
     if (FLAG_SET(PRINT_NON_LEAVES))
-      g_print ("%*s %6d\n", tree->level * 2, "", tree->count);
+      g_print ("%*s %6" G_GUINT64_FORMAT "\n", tree->level * 2, "", tree->count);
     g_assert (tree->red == 0);
     g_assert (tree->green == 0);
     g_assert (tree->blue == 0);
     for (i = 0; i < 8; i++) {
       if (tree->children[i])
-	gifenc_octree_print (tree->children[i], flags);
+	gifenc_octree_print (info, tree->children[i], flags);
     }
   }
 #undef FLAG_SET
@@ -193,7 +345,7 @@ color_to_index (guint color, guint level)
 }
 
 static void
-gifenc_octree_add_one (GifencOctree *tree, guint32 color, guint count)
+gifenc_octree_add_one (GifencOctree *tree, guint32 color, guint64 count)
 {
   tree->red += ((color >> 16) & 0xFF) * count;
   tree->green += ((color >> 8) & 0xFF) * count;
@@ -201,27 +353,30 @@ gifenc_octree_add_one (GifencOctree *tree, guint32 color, guint count)
 }
 
 static void
-gifenc_octree_add_color (OctreeInfo *info, guint32 color, guint count)
+gifenc_octree_add_color (OctreeInfo *info, guint32 color, guint64 count)
 {
   guint i;
-  GifencOctree *tree = info->tree;
+  guint32 node, new;
+  GifencOctree *tree, *child;
 
   color &= 0xFFFFFF;
 
+  node = 0;
   for (;;) {
+    tree = OCTREE_NODE (info, node);
     tree->count += count;
     if (tree->level == 8 || OCTREE_IS_LEAF (tree)) {
       if (tree->color < 0x1000000 && tree->color != color) {
-	GifencOctree *new = gifenc_octree_new ();
-	new->level = tree->level + 1;
-	new->count = tree->count - count;
-	new->red = tree->red; tree->red = 0;
-	new->green = tree->green; tree->green = 0;
-	new->blue = tree->blue; tree->blue = 0;
-	new->color = tree->color; tree->color = (guint) -1;
-	i = color_to_index (new->color, tree->level);
+	new = gifenc_octree_new (info, node, tree->level + 1);
+	tree = OCTREE_NODE (info, node);
+	child = OCTREE_NODE (info, new);
+	child->count = tree->count - count;
+	child->red = tree->red; tree->red = 0;
+	child->green = tree->green; tree->green = 0;
+	child->blue = tree->blue; tree->blue = 0;
+	child->color = tree->color; tree->color = (guint) -1;
+	i = color_to_index (child->color, tree->level);
 	tree->children[i] = new;
-	info->non_leaves = g_slist_prepend (info->non_leaves, tree);
       } else {
 	gifenc_octree_add_one (tree, color, count);
 	return;
@@ -229,69 +384,177 @@ gifenc_octree_add_color (OctreeInfo *info, guint32 color, guint count)
     } 
     i = color_to_index (color, tree->level);
     if (tree->children[i]) {
-      tree = tree->children[i];
+      node = tree->children[i];
     } else {
-      GifencOctree *new = gifenc_octree_new ();
-      new->level = tree->level + 1;
-      gifenc_octree_add_one (new, color, count);
-      new->count = count;
-      new->color = color;
-      tree->children[i] = new;
+      new = gifenc_octree_new (info, node, tree->level + 1);
+      child = OCTREE_NODE (info, new);
+      gifenc_octree_add_one (child, color, count);
+      child->count = count;
+      child->color = color;
+      OCTREE_NODE (info, node)->children[i] = new;
       info->num_leaves++;
       return;
     }
   }
 }
 
-static int
-octree_compare_count (gconstpointer a, gconstpointer b)
+/* Only nodes with nothing but leaves below them can be reduced. */
+static gboolean
+gifenc_octree_is_reducible (OctreeInfo *info, const GifencOctree *tree)
+{
+  guint i;
+
+  if (OCTREE_IS_LEAF (tree))
+    return FALSE;
+  for (i = 0; i < 8; i++) {
+    if (tree->children[i] && 
+	!OCTREE_IS_LEAF (OCTREE_NODE (info, tree->children[i])))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* How much the squared error of the palette grows when the children of tree
+ * are replaced by their average color. */
+static gdouble
+gifenc_octree_reduce_cost (OctreeInfo *info, const GifencOctree *tree)
 {
-  return ((const GifencOctree *) a)->count - ((const GifencOctree *) b)->count;
+  const GifencOctree *child;
+  gdouble red = 0, green = 0, blue = 0, cost = 0;
+  guint i;
+
+  for (i = 0; i < 8; i++) {
+    if (!tree->children[i])
+      continue;
+    child = OCTREE_NODE (info, tree->children[i]);
+    cost += ((gdouble) child->red * child->red +
+	(gdouble) child->green * child->green +
+	(gdouble) child->blue * child->blue) / child->count;
+    red += child->red;
+    green += child->green;
+    blue += child->blue;
+  }
+  return cost - (red * red + green * green + blue * blue) / tree->count;
 }
 
+/* the children's nodes are put on the list of nodes to reuse */
 static void
-gifenc_octree_reduce_one (OctreeInfo *info, GifencOctree *tree)
+gifenc_octree_reduce_one (OctreeInfo *info, guint32 node)
 {
+  GifencOctree *tree = OCTREE_NODE (info, node);
+  GifencOctree *child;
   guint i;
 
-  g_assert (!OCTREE_IS_LEAF (tree));
+  g_assert (gifenc_octree_is_reducible (info, tree));
   for (i = 0; i < 8; i++) {
     if (!tree->children[i])
       continue;
-    g_assert (OCTREE_IS_LEAF (tree->children[i]));
-    tree->red += tree->children[i]->red;
-    tree->green += tree->children[i]->green;
-    tree->blue += tree->children[i]->blue;
-    gifenc_octree_free (tree->children[i]);
-    tree->children[i] = NULL;
+    child = OCTREE_NODE (info, tree->children[i]);
+    tree->red += child->red;
+    tree->green += child->green;
+    tree->blue += child->blue;
+    child->parent = info->free_nodes;
+    info->free_nodes = tree->children[i];
+    tree->children[i] = 0;
     info->num_leaves--;
   }
   tree->color = 0x1000000;
   info->num_leaves++;
-  info->non_leaves = g_slist_remove (info->non_leaves, tree);
+}
+
+/* binary min-heap of the nodes that can be reduced, keyed on their cost */
+typedef struct {
+  gdouble		cost;
+  guint32		node;
+} OctreeReduction;
+
+#define REDUCTION_LESS(a, b) ((a)->cost < (b)->cost || \
+    ((a)->cost == (b)->cost && (a)->node < (b)->node))
+
+static void
+gifenc_octree_queue_sift_down (OctreeReduction *heap, guint n_heap, guint i)
+{
+  OctreeReduction r = heap[i];
+  guint child;
+
+  for (; (child = 2 * i + 1) < n_heap; i = child) {
+    if (child + 1 < n_heap && REDUCTION_LESS (&heap[child + 1], &heap[child]))
+      child++;
+    if (!REDUCTION_LESS (&heap[child], &r))
+      break;
+    heap[i] = heap[child];
+  }
+  heap[i] = r;
 }
 
+static void
+gifenc_octree_queue_push (OctreeReduction *heap, guint *n_heap, 
+    OctreeInfo *info, guint32 node)
+{
+  OctreeReduction r;
+  guint i;
+
+  r.cost = gifenc_octree_reduce_cost (info, OCTREE_NODE (info, node));
+  r.node = node;
+  for (i = (*n_heap)++; i > 0 && REDUCTION_LESS (&r, &heap[(i - 1) / 2]); i = (i - 1) / 2)
+    heap[i] = heap[(i - 1) / 2];
+  heap[i] = r;
+}
+
+static guint32
+gifenc_octree_queue_pop (OctreeReduction *heap, guint *n_heap)
+{
+  guint32 node;
+
+  node = heap[0].node;
+  heap[0] = heap[--(*n_heap)];
+  gifenc_octree_queue_sift_down (heap, *n_heap, 0);
+  return node;
+}
+
+/* Reduces the cheapest nodes first. Once all children of a node are leaves, 
+ * it can be reduced itself. The root is never reduced. */
 static void
 gifenc_octree_reduce_colors (OctreeInfo *info, guint stop)
 {
-  info->non_leaves = g_slist_sort (info->non_leaves, octree_compare_count);
-  //g_print ("reducing %u leaves (%u non-leaves)\n", info->num_leaves, 
-  //    g_slist_length (info->non_leaves));
-  while (info->num_leaves > stop) {
-    gifenc_octree_reduce_one (info, info->non_leaves->data);
+  OctreeReduction *heap;
+  guint32 node, parent;
+  guint i, n_heap = 0;
+
+  heap = g_new (OctreeReduction, info->n_nodes);
+  for (node = 1; node < info->n_nodes; node++) {
+    if (gifenc_octree_is_reducible (info, OCTREE_NODE (info, node))) {
+      heap[n_heap].cost = gifenc_octree_reduce_cost (info, OCTREE_NODE (info, node));
+      heap[n_heap].node = node;
+      n_heap++;
+    }
+  }
+  for (i = n_heap / 2; i > 0; i--)
+    gifenc_octree_queue_sift_down (heap, n_heap, i - 1);
+  //g_print ("reducing %u leaves (%u reducible)\n", info->num_leaves, n_heap);
+  while (info->num_leaves > stop && n_heap > 0) {
+    node = gifenc_octree_queue_pop (heap, &n_heap);
+    gifenc_octree_reduce_one (info, node);
+    parent = OCTREE_NODE (info, node)->parent;
+    if (parent != 0 && gifenc_octree_is_reducible (info, OCTREE_NODE (info, parent)))
+      gifenc_octree_queue_push (heap, &n_heap, info, parent);
   }
   //g_print (" ==> to %u leaves\n", info->num_leaves);
+  g_free (heap);
 }
 
 static guint
-gifenc_octree_finalize (GifencOctree *tree, guint start_id, guint *colors)
+gifenc_octree_finalize (OctreeInfo *info, guint32 node, guint start_id, 
+    guint *colors)
 {
+  GifencOctree *tree = OCTREE_NODE (info, node);
+
   if (OCTREE_IS_LEAF (tree)) {
     if (tree->color > 0xFFFFFF)
       tree->color = 
-	((tree->red / tree->count) << 16) |
-	((tree->green / tree->count) << 8) |
-	(tree->blue / tree->count);
+	((guint32) (tree->red / tree->count) << 16) |
+	((guint32) (tree->green / tree->count) << 8) |
+	(guint32) (tree->blue / tree->count);
     tree->id = start_id;
     colors[start_id] = tree->color;
     return tree->id + 1;
@@ -299,7 +562,7 @@ gifenc_octree_finalize (GifencOctree *tree, guint start_id, guint *colors)
     guint i;
     for (i = 0; i < 8; i++) {
       if (tree->children[i])
-	start_id = gifenc_octree_finalize (tree->children[i], start_id, colors);
+	start_id = gifenc_octree_finalize (info, tree->children[i], start_id, colors);
     }
     return start_id;
   }
@@ -307,60 +570,124 @@ gifenc_octree_finalize (GifencOctree *tree, guint start_id, guint *colors)
   return 0;
 }
 
-static guint
-gifenc_octree_lookup (gpointer data, guint32 color, guint32 *looked_up_color)
+/* Goes down one level towards color. If there is no child for the color, 
+ * a sibling is picked. */
+static inline guint32
+gifenc_octree_descend (const GifencOctree *tree, guint32 color)
 {
-  GifencOctree *tree = data;
-  guint idx;
+  static const guint order[8][7] = {
+    { 2, 1, 4, 3, 6, 5, 7 },
+    { 3, 0, 5, 2, 7, 4, 6 },
+    { 0, 3, 6, 1, 4, 7, 5 },
+    { 1, 2, 7, 6, 5, 0, 4 },
+    { 6, 5, 0, 7, 2, 1, 3 },
+    { 7, 4, 1, 6, 3, 0, 2 },
+    { 4, 7, 2, 5, 0, 3, 1 },
+    { 5, 6, 3, 4, 1, 2, 0 }
+  };
+  guint i, idx;
 
-  if (OCTREE_IS_LEAF (tree)) {
-    *looked_up_color = tree->color;
-    return tree->id;
-  } 
   idx = color_to_index (color, tree->level);
-  if (tree->children[idx] == NULL) {
-    static const guint order[8][7] = {
-      { 2, 1, 4, 3, 6, 5, 7 },
-      { 3, 0, 5, 2, 7, 4, 6 },
-      { 0, 3, 6, 1, 4, 7, 5 },
-      { 1, 2, 7, 6, 5, 0, 4 },
-      { 6, 5, 0, 7, 2, 1, 3 },
-      { 7, 4, 1, 6, 3, 0, 2 },
-      { 4, 7, 2, 5, 0, 3, 1 },
-      { 5, 6, 3, 4, 1, 2, 0 }
-    };
-    guint i, tmp;
-    for (i = 0; i < 7; i++) {
-      tmp = order[idx][i];
-      if (!tree->children[tmp])
-	continue;
-      /* make selection smarter, like using closest match */
-      return gifenc_octree_lookup (
-	  tree->children[tmp],
-	  color, looked_up_color);
-    }
-    g_assert_not_reached ();
+  if (tree->children[idx])
+    return tree->children[idx];
+  for (i = 0; i < 7; i++) {
+    /* make selection smarter, like using closest match */
+    if (tree->children[order[idx][i]])
+      return tree->children[order[idx][i]];
   }
-  return gifenc_octree_lookup (
-      tree->children[idx],
-      color, looked_up_color);
+  g_assert_not_reached ();
+  return 0;
 }
 
-GifencPalette *
-gifenc_quantize_image (const guint8 *data, guint width, guint height,
-    guint rowstride, gboolean alpha, guint max_colors)
+/* The first CACHE_BITS levels of the tree only look at the top CACHE_BITS 
+ * bits of every channel, so the node a lookup reaches there can be cached 
+ * per RGB555 color. Most of the time that node is a leaf already. */
+#define CACHE_BITS 5
+#define CACHE_INDEX(color) ((((color) >> (24 - 3 * CACHE_BITS)) & 0x7C00) | \
+    (((color) >> (16 - 2 * CACHE_BITS)) & 0x3E0) | \
+    (((color) >> (8 - CACHE_BITS)) & 0x1F))
+
+typedef struct {
+  GifencOctree *	nodes;
+  guint *		colors;		/* the palette's colors */
+  guint32		cache[1 << (3 * CACHE_BITS)]; /* node reached for color */
+} GifencOctreePalette;
+
+static void
+gifenc_octree_palette_free (gpointer data)
 {
-  guint x, y;
-  const guint32 *row;
-  OctreeInfo info = { NULL, NULL, 0 };
+  GifencOctreePalette *octree = data;
+
+  g_free (octree->nodes);
+  g_free (octree->colors);
+  g_free (octree);
+}
+
+static GifencOctreePalette *
+gifenc_octree_palette_new (GifencOctree *nodes, guint *colors)
+{
+  GifencOctreePalette *octree;
+  guint32 node, color;
+  guint i;
+
+  octree = g_new (GifencOctreePalette, 1);
+  octree->nodes = nodes;
+  octree->colors = colors;
+  for (i = 0; i < G_N_ELEMENTS (octree->cache); i++) {
+    color = ((i & 0x7C00) << 9) | ((i & 0x3E0) << 6) | ((i & 0x1F) << 3);
+    node = 0;
+    while (!OCTREE_IS_LEAF (&nodes[node]) && nodes[node].level < CACHE_BITS)
+      node = gifenc_octree_descend (&nodes[node], color);
+    octree->cache[i] = node;
+  }
+
+  return octree;
+}
+
+static guint
+gifenc_octree_lookup (gpointer data, guint32 color, guint32 *looked_up_color)
+{
+  GifencOctreePalette *octree = data;
+  const GifencOctree *tree;
+
+  tree = &octree->nodes[octree->cache[CACHE_INDEX (color)]];
+  while (!OCTREE_IS_LEAF (tree))
+    tree = &octree->nodes[gifenc_octree_descend (tree, color)];
+
+  *looked_up_color = tree->color;
+  return tree->id;
+}
+
+/* number of entries of a color table with n_colors colors */
+static guint
+gifenc_table_size (guint n_colors)
+{
+  guint size;
+
+  /* the LZW code size is at least 2 bits */
+  for (size = 4; size < n_colors; size *= 2);
+  return size;
+}
+
+static GifencPalette *
+gifenc_quantize_octree (const GifencHistogram *histogram, gboolean alpha,
+    guint max_colors, gboolean complete)
+{
+  OctreeInfo info = { NULL, 0, 0, 0, 0 };
   GifencPalette *palette;
+  guint i, n_colors;
   
-  g_return_val_if_fail (width * height <= (G_MAXUINT >> 8), NULL);
-
-  info.tree = gifenc_octree_new ();
-  info.tree->color = (guint) -2; /* special node */
+  gifenc_octree_new (&info, 0, 0);
+  info.nodes[0].color = (guint) -2; /* special node */
 
-  if (TRUE) {
+  /* The 64 colors of a color cube give good matches for colors showing up
+   * in later images. If the histogram has all colors and they fit into the
+   * palette, only add them when they fit into the same power of 2, as the 
+   * color table and the LZW code size would grow otherwise. */
+  n_colors = histogram->n_colors + (alpha ? 1 : 0);
+  if (!complete || n_colors > max_colors || 
+      (n_colors + 64 <= max_colors && 
+       gifenc_table_size (n_colors + 64) == gifenc_table_size (n_colors))) {
     guint r, g, b;
     static const guint8 colors[] = { 0, 85, 170, 255 };
     for (r = 0; r < 4; r++) {
@@ -373,33 +700,386 @@ gifenc_quantize_image (const guint8 *data, guint width, guint height,
     }
   }
   
-  for (y = 0; y < height; y++) {
-    row = (const guint32 *) data;
-    for (x = 0; x < width; x++) {
-      gifenc_octree_add_color (&info, row[x] & 0xFFFFFF, 1);
-    }
-    //if (info.num_leaves > MAX_LEAVES)
-    //  gifenc_octree_reduce_colors (&info, STOP_LEAVES);
-    data += rowstride;
+  for (i = 0; i < histogram->size; i++) {
+    if (histogram->colors[i] == GIFENC_HISTOGRAM_EMPTY)
+      continue;
+    gifenc_octree_add_color (&info, histogram->colors[i], histogram->counts[i]);
+    /* keep the tree small for histograms with lots of colors */
+    if (info.num_leaves > MAX_LEAVES)
+      gifenc_octree_reduce_colors (&info, STOP_LEAVES);
   }
-  //gifenc_octree_print (info.tree, 1);
+  //gifenc_octree_print (&info, 0, 1);
   gifenc_octree_reduce_colors (&info, max_colors - (alpha ? 1 : 0));
   
-  //gifenc_octree_print (info.tree, 1);
-  //g_print ("total: %u colors (%u non-leaves)\n", info.num_leaves, 
-  //    g_slist_length (info.non_leaves));
+  //gifenc_octree_print (&info, 0, 1);
+  //g_print ("total: %u colors\n", info.num_leaves);
 
   palette = g_new (GifencPalette, 1);
   palette->alpha = alpha;
   palette->colors = g_new (guint, info.num_leaves);
   palette->num_colors = info.num_leaves;
-  palette->data = info.tree;
   palette->lookup = gifenc_octree_lookup;
-  palette->free = gifenc_octree_free;
+  palette->free = gifenc_octree_palette_free;
 
-  gifenc_octree_finalize (info.tree, 0, palette->colors);
-  g_slist_free (info.non_leaves);
+  gifenc_octree_finalize (&info, 0, 0, palette->colors);
+  palette->data = gifenc_octree_palette_new (info.nodes, palette->colors);
 
   return (GifencPalette *) palette;
 }
 
+/*** WU QUANTIZATION ***/
+
+/* Xiaolin Wu's quantizer, see "Efficient Statistical Computations for 
+ * Optimal Color Quantization" in Graphics Gems II. Colors are counted in a
+ * table of moments for every RGB555 cell, which is then summed up so the 
+ * moments of any box can be read off its 8 corners. The box with the 
+ * largest variance is split until there are enough boxes. Index 0 of every
+ * axis stays empty for the corners of boxes starting at the origin. */
+#define WU_SIZE ((1 << CACHE_BITS) + 1)
+#define WU_INDEX(r, g, b) (((r) * WU_SIZE + (g)) * WU_SIZE + (b))
+
+typedef struct {
+  gint64		weight;		/* amount of pixels */
+  gint64		red;		/* sum of red values */
+  gint64		green;		/* sum of green values */
+  gint64		blue;		/* sum of blue values */
+  gdouble		square;		/* sum of squared lengths of the colors */
+} WuMoment;
+
+typedef struct {
+  guint			r0, r1;		/* red range, r0 exclusive */
+  guint			g0, g1;		/* green range, g0 exclusive */
+  guint			b0, b1;		/* blue range, b0 exclusive */
+  guint			volume;		/* number of cells in the box */
+} WuBox;
+
+typedef struct {
+  guint32		colors[256];
+  guint8		index[1 << (3 * CACHE_BITS)]; /* box of every RGB555 cell */
+} GifencWuPalette;
+
+static void
+gifenc_wu_add_color (WuMoment *moments, guint32 color, guint64 count)
+{
+  guint r = (color >> 16) & 0xFF, g = (color >> 8) & 0xFF, b = color & 0xFF;
+  WuMoment *m;
+
+  m = &moments[WU_INDEX ((r >> (8 - CACHE_BITS)) + 1, 
+      (g >> (8 - CACHE_BITS)) + 1, (b >> (8 - CACHE_BITS)) + 1)];
+  m->weight += count;
+  m->red += (gint64) r * count;
+  m->green += (gint64) g * count;
+  m->blue += (gint64) b * count;
+  m->square += (gdouble) (r * r + g * g + b * b) * count;
+}
+
+/* turns the moments of every cell into the moments of the box between the
+ * origin and that cell */
+static void
+gifenc_wu_accumulate (WuMoment *moments)
+{
+  static const guint step[3] = { WU_SIZE * WU_SIZE, WU_SIZE, 1 };
+  guint axis, r, g, b;
+  WuMoment *m, *prev;
+
+  for (axis = 0; axis < 3; axis++) {
+    for (r = 1; r < WU_SIZE; r++) {
+      for (g = 1; g < WU_SIZE; g++) {
+	for (b = 1; b < WU_SIZE; b++) {
+	  m = &moments[WU_INDEX (r, g, b)];
+	  prev = m - step[axis];
+	  m->weight += prev->weight;
+	  m->red += prev->red;
+	  m->green += prev->green;
+	  m->blue += prev->blue;
+	  m->square += prev->square;
+	}
+      }
+    }
+  }
+}
+
+static void
+gifenc_wu_volume (const WuMoment *moments, const WuBox *box, WuMoment *result)
+{
+  const WuMoment *m;
+  guint i;
+
+  memset (result, 0, sizeof (WuMoment));
+  for (i = 0; i < 8; i++) {
+    m = &moments[WU_INDEX (i & 4 ? box->r1 : box->r0,
+	i & 2 ? box->g1 : box->g0, i & 1 ? box->b1 : box->b0)];
+    /* corners with an odd number of lower bounds are subtracted */
+    if (((i >> 2) ^ (i >> 1) ^ i) & 1) {
+      result->weight += m->weight;
+      result->red += m->red;
+      result->green += m->green;
+      result->blue += m->blue;
+      result->square += m->square;
+    } else {
+      result->weight -= m->weight;
+      result->red -= m->red;
+      result->green -= m->green;
+      result->blue -= m->blue;
+      result->square -= m->square;
+    }
+  }
+}
+
+static gdouble
+gifenc_wu_variance (const WuMoment *moments, const WuBox *box)
+{
+  WuMoment sum;
+
+  gifenc_wu_volume (moments, box, &sum);
+  if (sum.weight == 0)
+    return 0;
+
+  return sum.square - ((gdouble) sum.red * sum.red + 
+      (gdouble) sum.green * sum.green + 
+      (gdouble) sum.blue * sum.blue) / sum.weight;
+}
+
+/* Finds the cut along axis that leaves the least variance in both halves.
+ * Returns G_MAXUINT if every cut leaves one half empty. */
+static guint
+gifenc_wu_maximize (const WuMoment *moments, const WuBox *box, guint axis,
+    const WuMoment *whole, gdouble *max)
+{
+  WuMoment half;
+  gint64 red, green, blue, weight;
+  WuBox lower = *box;
+  guint *upper, first, last, cut, i;
+  gdouble value;
+
+  switch (axis) {
+    case 0:
+      upper = &lower.r1;
+      first = box->r0;
+      last = box->r1;
+      break;
+    case 1:
+      upper = &lower.g1;
+      first = box->g0;
+      last = box->g1;
+      break;
+    case 2:
+      upper = &lower.b1;
+      first = box->b0;
+      last = box->b1;
+      break;
+    default:
+      g_assert_not_reached ();
+      return G_MAXUINT;
+  }
+
+  cut = G_MAXUINT;
+  *max = 0;
+  for (i = first + 1; i < last; i++) {
+    *upper = i;
+    gifenc_wu_volume (moments, &lower, &half);
+    if (half.weight == 0)
+      continue;
+    weight = whole->weight - half.weight;
+    if (weight == 0)
+      break;
+    red = whole->red - half.red;
+    green = whole->green - half.green;
+    blue = whole->blue - half.blue;
+    value = ((gdouble) half.red * half.red + (gdouble) half.green * half.green +
+	(gdouble) half.blue * half.blue) / half.weight +
+	((gdouble) red * red + (gdouble) green * green + 
+	(gdouble) blue * blue) / weight;
+    if (value > *max) {
+      *max = value;
+      cut = i;
+    }
+  }
+
+  return cut;
+}
+
+/* splits box in two, putting the upper half into new_box */
+static gboolean
+gifenc_wu_cut (const WuMoment *moments, WuBox *box, WuBox *new_box)
+{
+  WuMoment whole;
+  gdouble max[3];
+  guint cut[3], axis;
+
+  gifenc_wu_volume (moments, box, &whole);
+  for (axis = 0; axis < 3; axis++)
+    cut[axis] = gifenc_wu_maximize (moments, box, axis, &whole, &max[axis]);
+  if (max[0] >= max[1] && max[0] >= max[2])
+    axis = 0;
+  else if (max[1] >= max[2])
+    axis = 1;
+  else
+    axis = 2;
+  if (cut[axis] == G_MAXUINT)
+    return FALSE;
+
+  *new_box = *box;
+  if (axis == 0)
+    new_box->r0 = box->r1 = cut[0];
+  else if (axis == 1)
+    new_box->g0 = box->g1 = cut[1];
+  else
+    new_box->b0 = box->b1 = cut[2];
+  box->volume = (box->r1 - box->r0) * (box->g1 - box->g0) * (box->b1 - box->b0);
+  new_box->volume = (new_box->r1 - new_box->r0) * 
+      (new_box->g1 - new_box->g0) * (new_box->b1 - new_box->b0);
+
+  return TRUE;
+}
+
+static guint
+gifenc_wu_lookup (gpointer data, guint32 color, guint32 *looked_up_color)
+{
+  GifencWuPalette *wu = data;
+  guint id;
+
+  id = wu->index[CACHE_INDEX (color)];
+  *looked_up_color = wu->colors[id];
+  return id;
+}
+
+static GifencPalette *
+gifenc_quantize_wu (const GifencHistogram *histogram, gboolean alpha,
+    guint max_colors)
+{
+  WuBox boxes[256];
+  gdouble variance[256];
+  GifencWuPalette *wu;
+  GifencPalette *palette;
+  WuMoment *moments, sum;
+  guint i, k, next, n_boxes, r, g, b;
+
+  n_boxes = CLAMP ((gint) max_colors - (alpha ? 1 : 0), 1, 256);
+  moments = g_new0 (WuMoment, WU_SIZE * WU_SIZE * WU_SIZE);
+
+  /* like the octree, cover colors that are not in the image */
+  for (r = 0; r < 4; r++) {
+    for (g = 0; g < 4; g++) {
+      for (b = 0; b < 4; b++) {
+	gifenc_wu_add_color (moments, (r * 85 << 16) + (g * 85 << 8) + b * 85, 1);
+      }
+    }
+  }
+  for (i = 0; i < histogram->size; i++) {
+    if (histogram->colors[i] != GIFENC_HISTOGRAM_EMPTY)
+      gifenc_wu_add_color (moments, histogram->colors[i], histogram->counts[i]);
+  }
+  gifenc_wu_accumulate (moments);
+
+  boxes[0].r0 = boxes[0].g0 = boxes[0].b0 = 0;
+  boxes[0].r1 = boxes[0].g1 = boxes[0].b1 = WU_SIZE - 1;
+  boxes[0].volume = (WU_SIZE - 1) * (WU_SIZE - 1) * (WU_SIZE - 1);
+  variance[0] = 0;
+  next = 0;
+  for (i = 1; i < n_boxes; i++) {
+    if (gifenc_wu_cut (moments, &boxes[next], &boxes[i])) {
+      variance[next] = boxes[next].volume > 1 ? 
+	  gifenc_wu_variance (moments, &boxes[next]) : 0;
+      variance[i] = boxes[i].volume > 1 ? 
+	  gifenc_wu_variance (moments, &boxes[i]) : 0;
+    } else {
+      /* can't be split, try the next box */
+      variance[next] = 0;
+      i--;
+    }
+    next = 0;
+    for (k = 1; k <= i; k++) {
+      if (variance[k] > variance[next])
+	next = k;
+    }
+    if (variance[next] <= 0) {
+      n_boxes = i + 1;
+      break;
+    }
+  }
+
+  wu = g_new (GifencWuPalette, 1);
+  for (k = 0; k < n_boxes; k++) {
+    gifenc_wu_volume (moments, &boxes[k], &sum);
+    wu->colors[k] = 
+	((guint32) ((sum.red + sum.weight / 2) / sum.weight) << 16) |
+	((guint32) ((sum.green + sum.weight / 2) / sum.weight) << 8) |
+	(guint32) ((sum.blue + sum.weight / 2) / sum.weight);
+    for (r = boxes[k].r0; r < boxes[k].r1; r++) {
+      for (g = boxes[k].g0; g < boxes[k].g1; g++) {
+	for (b = boxes[k].b0; b < boxes[k].b1; b++) {
+	  wu->index[(r << (2 * CACHE_BITS)) | (g << CACHE_BITS) | b] = k;
+	}
+      }
+    }
+  }
+  g_free (moments);
+
+  palette = g_new (GifencPalette, 1);
+  palette->alpha = alpha;
+  palette->colors = wu->colors;
+  palette->num_colors = n_boxes;
+  palette->data = wu;
+  palette->lookup = gifenc_wu_lookup;
+  palette->free = g_free;
+
+  return palette;
+}
+
+/**
+ * gifenc_quantize_histogram:
+ * @histogram: colors to create a palette for
+ * @quantizer: the algorithm to use
+ * @alpha: %TRUE to reserve an index for transparency
+ * @max_colors: maximum number of colors in the palette, including 
+ *              transparency
+ * @complete: %TRUE if @histogram contains every color the palette will be
+ *            used for
+ *
+ * Creates a palette for the colors in @histogram. As only the different 
+ * colors are looked at, this takes about as long for a large image as for
+ * a small one with the same colors. If @complete is set and all colors fit
+ * into @max_colors, the palette contains them exactly and is only as big 
+ * as needed, which lets images use shorter LZW codes. Otherwise room is 
+ * kept for colors that show up later.
+ *
+ * Returns: a new palette
+ **/
+GifencPalette *
+gifenc_quantize_histogram (const GifencHistogram *histogram, 
+    GifencQuantizer quantizer, gboolean alpha, guint max_colors, 
+    gboolean complete)
+{
+  g_return_val_if_fail (histogram != NULL, NULL);
+
+  /* the octree keeps every color if they all fit */
+  if (complete && histogram->n_colors + (alpha ? 1 : 0) <= max_colors)
+    quantizer = GIFENC_QUANTIZER_OCTREE;
+
+  switch (quantizer) {
+    case GIFENC_QUANTIZER_OCTREE:
+      return gifenc_quantize_octree (histogram, alpha, max_colors, complete);
+    case GIFENC_QUANTIZER_WU:
+      return gifenc_quantize_wu (histogram, alpha, max_colors);
+    default:
+      break;
+  }
+  g_return_val_if_reached (NULL);
+}
+
+GifencPalette *
+gifenc_quantize_image (const guint8 *data, guint width, guint height,
+    guint rowstride, gboolean alpha, guint max_colors)
+{
+  GifencHistogram *histogram;
+  GifencPalette *palette;
+
+  histogram = gifenc_histogram_new ();
+  gifenc_histogram_add_image (histogram, data, width, height, rowstride);
+  palette = gifenc_quantize_histogram (histogram, GIFENC_QUANTIZER_OCTREE, 
+      alpha, max_colors, FALSE);
+  gifenc_histogram_free (histogram);
+
+  return palette;
+}
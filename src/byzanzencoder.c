@@ -25,8 +25,15 @@
 
 #include <glib/gi18n-lib.h>
 
+#include "byzanzqueueinputstream.h"
 #include "byzanzserialize.h"
 
+/* When more than this many bytes of frames wait in the queue, consecutive 
+ * frames are merged before they are processed */
+#define BYZANZ_ENCODER_BACKLOG BYZANZ_QUEUE_FILE_SIZE
+/* frames are not merged across more than this many milliseconds */
+#define BYZANZ_ENCODER_COALESCE_MSECS 500
+
 typedef struct _ByzanzEncoderJob ByzanzEncoderJob;
 struct _ByzanzEncoderJob {
   GTimeVal		tv;		/* time this job was enqueued */
@@ -69,6 +76,49 @@ byzanz_encoder_finished (gpointer data)
 
 /*** INSIDE THREAD ***/
 
+static gboolean
+byzanz_encoder_is_behind (GInputStream *input)
+{
+  return BYZANZ_IS_QUEUE_INPUT_STREAM (input) &&
+    byzanz_queue_input_stream_get_backlog (BYZANZ_QUEUE_INPUT_STREAM (input)) > BYZANZ_ENCODER_BACKLOG;
+}
+
+/* Merges next into surface and region. Returns a new surface covering 
+ * the union of both regions with the pixels of next where they overlap. */
+static cairo_surface_t *
+byzanz_encoder_coalesce (cairo_surface_t *      surface,
+                         cairo_region_t *       region,
+                         cairo_surface_t *      next,
+                         const cairo_region_t * next_region)
+{
+  cairo_rectangle_int_t extents, rect;
+  cairo_surface_t *result;
+  cairo_t *cr;
+  int i, n_rects;
+
+  cairo_region_union (region, next_region);
+  cairo_region_get_extents (region, &extents);
+  result = cairo_image_surface_create (CAIRO_FORMAT_RGB24, extents.width, extents.height);
+  cairo_surface_set_device_offset (result, -extents.x, -extents.y);
+
+  cr = cairo_create (result);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr, surface, 0, 0);
+  cairo_paint (cr);
+
+  n_rects = cairo_region_num_rectangles (next_region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (next_region, i, &rect);
+    cairo_rectangle (cr, rect.x, rect.y, rect.width, rect.height);
+  }
+  cairo_set_source_surface (cr, next, 0, 0);
+  cairo_fill (cr);
+  cairo_destroy (cr);
+  cairo_surface_flush (result);
+
+  return result;
+}
+
 static gboolean
 byzanz_encoder_run (ByzanzEncoder * encoder,
                     GInputStream *  input,
@@ -79,10 +129,10 @@ byzanz_encoder_run (ByzanzEncoder * encoder,
 {
   ByzanzEncoderClass *klass = BYZANZ_ENCODER_GET_CLASS (encoder);
   guint width, height;
-  cairo_surface_t *surface;
-  cairo_region_t *region;
-  guint64 msecs;
-  gboolean success;
+  cairo_surface_t *surface, *next_surface, *merged;
+  cairo_region_t *region, *next_region;
+  guint64 msecs, next_msecs;
+  gboolean success, have_next;
 
   if (record_audio) {
     g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -94,9 +144,16 @@ byzanz_encoder_run (ByzanzEncoder * encoder,
       !klass->setup (encoder, output, width, height, cancellable, error))
     return FALSE;
 
+  have_next = FALSE;
   for (;;) {
-    if (!byzanz_deserialize (input , &msecs, &surface, &region, cancellable, error))
+    if (have_next) {
+      msecs = next_msecs;
+      surface = next_surface;
+      region = next_region;
+      have_next = FALSE;
+    } else if (!byzanz_deserialize (input , &msecs, &surface, &region, cancellable, error)) {
       return FALSE;
+    }
 
     /* quit */
     if (surface == NULL) {
@@ -104,12 +161,39 @@ byzanz_encoder_run (ByzanzEncoder * encoder,
         g_output_stream_close (output, cancellable, error);
     }
 
+    /* When recording is faster than encoding, fold the frames that wait in
+     * the queue into this one, so the encoder catches up instead of taking
+     * ages to finish after the recording stopped. The merged frame is shown
+     * until the frame after it starts, so it keeps their summed duration. */
+    while (byzanz_encoder_is_behind (input)) {
+      if (!byzanz_deserialize (input , &next_msecs, &next_surface, &next_region, cancellable, error)) {
+        cairo_surface_destroy (surface);
+        cairo_region_destroy (region);
+        return FALSE;
+      }
+      have_next = TRUE;
+      if (next_surface == NULL || next_msecs - msecs > BYZANZ_ENCODER_COALESCE_MSECS)
+        break;
+
+      merged = byzanz_encoder_coalesce (surface, region, next_surface, next_region);
+      cairo_surface_destroy (surface);
+      cairo_surface_destroy (next_surface);
+      cairo_region_destroy (next_region);
+      surface = merged;
+      have_next = FALSE;
+    }
+
     /* decode */
     success = klass->process (encoder, output, msecs, surface, region, cancellable, error);
     cairo_surface_destroy (surface);
     cairo_region_destroy (region);
-    if (!success)
+    if (!success) {
+      if (have_next && next_surface) {
+        cairo_surface_destroy (next_surface);
+        cairo_region_destroy (next_region);
+      }
       return FALSE;
+    }
   }
 }
 
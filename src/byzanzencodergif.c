@@ -26,10 +26,34 @@
 #include <string.h>
 #include <glib/gi18n.h>
 
+#include "byzanzserialize.h"
 #include "gifenc.h"
 
 G_DEFINE_TYPE (ByzanzEncoderGif, byzanz_encoder_gif, BYZANZ_TYPE_ENCODER)
 
+enum {
+  PROP_0,
+  PROP_COMPRESSION_LEVEL,
+  PROP_DITHER_METHOD,
+  PROP_TWO_PASS
+};
+
+GType
+byzanz_dither_method_get_type (void)
+{
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    { GIFENC_DITHER_FLOYD_STEINBERG, "GIFENC_DITHER_FLOYD_STEINBERG", "floyd-steinberg" },
+    { GIFENC_DITHER_ORDERED, "GIFENC_DITHER_ORDERED", "ordered" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter (&type))
+    g_once_init_leave (&type, g_enum_register_static ("GifencDitherMethod", values));
+
+  return type;
+}
+
 static gboolean
 byzanz_encoder_write_data (gpointer       closure,
                            const guchar * data,
@@ -42,6 +66,8 @@ byzanz_encoder_write_data (gpointer       closure,
       NULL, encoder->cancellable, error);
 }
 
+static void byzanz_encoder_gif_dither_thread (gpointer data, gpointer gif_ptr);
+
 static gboolean
 byzanz_encoder_gif_setup (ByzanzEncoder * encoder,
                           GOutputStream * stream,
@@ -51,27 +77,260 @@ byzanz_encoder_gif_setup (ByzanzEncoder * encoder,
                           GError **	  error)
 {
   ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (encoder);
+  guint i;
 
   gif->gifenc = gifenc_new (width, height, byzanz_encoder_write_data, encoder, NULL);
 
+  /* Overlap dithering and LZW encoding if we have the cores for it. Two
+   * frames are needed to dither while one frame waits for its duration, the
+   * others can be queued for the writer. */
+  gif->pipelined = g_get_num_processors () > 1;
+  gif->n_frames = gif->pipelined ? BYZANZ_ENCODER_GIF_MAX_FRAMES : 2;
+  /* full screen changes are compressed in strips on all cores */
+  gifenc_set_n_threads (gif->gifenc, g_get_num_processors ());
+  /* the encoding thread dithers a job itself */
+  gif->n_dither_jobs = MIN (g_get_num_processors (), BYZANZ_ENCODER_GIF_MAX_DITHER_JOBS);
+  if (gif->n_dither_jobs > 1)
+    gif->dither_pool = g_thread_pool_new (byzanz_encoder_gif_dither_thread, gif,
+        gif->n_dither_jobs - 1, FALSE, NULL);
+  gif->dither_rects = g_array_new (FALSE, FALSE, sizeof (ByzanzEncoderGifDitherRect));
+  for (i = 0; i < gif->n_dither_jobs; i++) {
+    gif->dither_jobs[i].context = gifenc_dither_context_new (width, height);
+  }
+
+  /* frames of a file can be read twice without keeping a copy */
+  if (G_IS_SEEKABLE (encoder->input_stream) &&
+      g_seekable_can_seek (G_SEEKABLE (encoder->input_stream)))
+    gif->input_offset = g_seekable_tell (G_SEEKABLE (encoder->input_stream));
+  else
+    gif->input_offset = -1;
+
   gif->image_data = g_malloc (width * height);
-  gif->cached_data = g_malloc (width * height);
-  gif->cached_tmp = g_malloc (width * height);
+  gif->shadow = g_malloc (width * height * 4);
+  gif->shadow_region = cairo_region_create ();
+  gif->free_frames = g_async_queue_new ();
+  /* frames allocate their memory when they are used */
+  for (i = 0; i < gif->n_frames; i++) {
+    g_async_queue_push (gif->free_frames, &gif->frames[i]);
+  }
   return TRUE;
 }
 
+/* address of pixel px, py of a frame's data or previous */
+#define BYZANZ_ENCODER_GIF_FRAME_PIXEL(frame, buffer, px, py) \
+  ((frame)->buffer + (gsize) (frame)->bounds.width * ((py) - (frame)->bounds.y) \
+   + (px) - (frame)->bounds.x)
+
+static gboolean
+byzanz_encoder_gif_write_frame (ByzanzEncoderGif *      gif,
+                                ByzanzEncoderGifFrame * frame,
+                                GError **               error)
+{
+  cairo_rectangle_int_t *area;
+  guint i, duration;
+
+  g_assert (frame->n_areas > 0);
+  g_assert (frame->duration >= BYZANZ_ENCODER_GIF_SUBIMAGE_DELAY * (frame->n_areas - 1));
+
+  gifenc_set_lossy (gif->gifenc, g_atomic_int_get (&gif->compression_level));
+
+  for (i = 0; i < frame->n_areas; i++) {
+    area = &frame->areas[i];
+    g_assert (area->width > 0);
+    g_assert (area->height > 0);
+
+    /* the last image of a frame is shown for the rest of the duration */
+    if (i + 1 < frame->n_areas)
+      duration = BYZANZ_ENCODER_GIF_SUBIMAGE_DELAY;
+    else
+      duration = frame->duration - BYZANZ_ENCODER_GIF_SUBIMAGE_DELAY * i;
+
+    if (frame->palette) {
+      if (!gifenc_add_image_with_palette (gif->gifenc, area->x, area->y, 
+                area->width, area->height, duration, frame->palette,
+                BYZANZ_ENCODER_GIF_FRAME_PIXEL (frame, data, area->x, area->y),
+                frame->bounds.width, error))
+        return FALSE;
+    /* unchanged pixels may be encoded as what is shown already */
+    } else if (!gifenc_add_image_with_previous (gif->gifenc, area->x, area->y, 
+              area->width, area->height, duration,
+              BYZANZ_ENCODER_GIF_FRAME_PIXEL (frame, data, area->x, area->y),
+              frame->bounds.width,
+              BYZANZ_ENCODER_GIF_FRAME_PIXEL (frame, previous, area->x, area->y),
+              frame->bounds.width, error)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/*** WRITER THREAD ***/
+
+static gpointer
+byzanz_encoder_gif_writer (gpointer data)
+{
+  ByzanzEncoderGif *gif = data;
+  ByzanzEncoderGifFrame *frame;
+  GError *error = NULL;
+
+  for (;;) {
+    frame = g_async_queue_pop (gif->encode_frames);
+    /* the encoder itself is used to signal the end */
+    if (frame == (gpointer) gif)
+      break;
+
+    /* keep returning frames after an error so the dithering never blocks */
+    if (error == NULL &&
+        !byzanz_encoder_gif_write_frame (gif, frame, &error))
+      g_atomic_pointer_set (&gif->writer_error, error);
+
+    g_async_queue_push (gif->free_frames, frame);
+  }
+
+  return NULL;
+}
+
+static void
+byzanz_encoder_gif_start_writer (ByzanzEncoderGif *gif)
+{
+  g_assert (gif->writer == NULL);
+
+  gif->encode_frames = g_async_queue_new ();
+  gif->writer = g_thread_new ("gif writer", byzanz_encoder_gif_writer, gif);
+}
+
+static void
+byzanz_encoder_gif_stop_writer (ByzanzEncoderGif *gif)
+{
+  if (gif->writer == NULL)
+    return;
+
+  g_async_queue_push (gif->encode_frames, gif);
+  g_thread_join (gif->writer);
+  gif->writer = NULL;
+}
+
+static gboolean
+byzanz_encoder_gif_check_writer (ByzanzEncoderGif *gif,
+                                 GError **         error)
+{
+  GError *writer_error = g_atomic_pointer_get (&gif->writer_error);
+
+  if (writer_error == NULL)
+    return TRUE;
+
+  g_propagate_error (error, g_error_copy (writer_error));
+  return FALSE;
+}
+
+/* hands the frame to LZW encoding, after which it is put back into
+ * free_frames */
+static gboolean
+byzanz_encoder_gif_submit_frame (ByzanzEncoderGif *      gif,
+                                 ByzanzEncoderGifFrame * frame,
+                                 GError **               error)
+{
+  gboolean result;
+
+  if (gif->writer) {
+    if (!byzanz_encoder_gif_check_writer (gif, error)) {
+      g_async_queue_push (gif->free_frames, frame);
+      return FALSE;
+    }
+    g_async_queue_push (gif->encode_frames, frame);
+    return TRUE;
+  }
+
+  result = byzanz_encoder_gif_write_frame (gif, frame, error);
+  g_async_queue_push (gif->free_frames, frame);
+  return result;
+}
+
+/*** ENCODER THREAD ***/
+
+typedef struct {
+  GifencHistogram *     histogram;      /* colors of the band */
+  const guint8 *        data;           /* first row of the band */
+  guint                 width;          /* width of the band */
+  guint                 height;         /* rows in the band */
+  guint                 stride;         /* rowstride of data */
+} ByzanzEncoderGifHistogramBand;
+
+static gpointer
+byzanz_encoder_gif_histogram_thread (gpointer data)
+{
+  ByzanzEncoderGifHistogramBand *band = data;
+
+  gifenc_histogram_add_image (band->histogram, band->data, band->width,
+      band->height, band->stride);
+  return NULL;
+}
+
+/* counts the colors of the surface in bands of rows, one per thread */
+static GifencHistogram *
+byzanz_encoder_gif_histogram (ByzanzEncoderGif * gif,
+                              cairo_surface_t *  surface)
+{
+  ByzanzEncoderGifHistogramBand bands[BYZANZ_ENCODER_GIF_MAX_DITHER_JOBS];
+  GThread *threads[BYZANZ_ENCODER_GIF_MAX_DITHER_JOBS];
+  guint i, y, rows, n_bands, width, height, stride;
+  const guint8 *data;
+
+  data = cairo_image_surface_get_data (surface);
+  width = cairo_image_surface_get_width (surface);
+  height = cairo_image_surface_get_height (surface);
+  stride = cairo_image_surface_get_stride (surface);
+
+  n_bands = MIN (gif->n_dither_jobs,
+      (guint64) width * height / BYZANZ_ENCODER_GIF_DITHER_JOB_PIXELS);
+  n_bands = CLAMP (n_bands, 1, MAX (height, 1));
+  rows = (height + n_bands - 1) / n_bands;
+  n_bands = MAX ((height + rows - 1) / rows, 1);
+
+  for (i = 0, y = 0; i < n_bands; i++, y += rows) {
+    bands[i].histogram = gifenc_histogram_new ();
+    bands[i].data = data + y * stride;
+    bands[i].width = width;
+    bands[i].height = MIN (rows, height - y);
+    bands[i].stride = stride;
+  }
+  for (i = 1; i < n_bands; i++) {
+    threads[i] = g_thread_new ("gif histogram",
+        byzanz_encoder_gif_histogram_thread, &bands[i]);
+  }
+  byzanz_encoder_gif_histogram_thread (&bands[0]);
+  for (i = 1; i < n_bands; i++) {
+    g_thread_join (threads[i]);
+    gifenc_histogram_merge (bands[0].histogram, bands[i].histogram);
+    gifenc_histogram_free (bands[i].histogram);
+  }
+
+  return bands[0].histogram;
+}
+
 static gboolean
 byzanz_encoder_gif_quantize (ByzanzEncoderGif * gif,
                              cairo_surface_t *  surface,
                              GError **          error)
 {
+  GifencHistogram *histogram;
   GifencPalette *palette;
+  gboolean complete;
 
   g_assert (!gif->has_quantized);
 
-  palette = gifenc_quantize_image (cairo_image_surface_get_data (surface),
-      cairo_image_surface_get_width (surface), cairo_image_surface_get_height (surface),
-      cairo_image_surface_get_stride (surface), TRUE, 255);
+  /* in two pass mode, all frames have been counted already */
+  complete = gif->histogram != NULL;
+  if (complete) {
+    histogram = gif->histogram;
+    gif->histogram = NULL;
+  } else {
+    histogram = byzanz_encoder_gif_histogram (gif, surface);
+  }
+  palette = gifenc_quantize_histogram (histogram, 
+      gif->gifenc->quantizer, TRUE, 255, complete);
+  gifenc_histogram_free (histogram);
   
   if (!gifenc_initialize (gif->gifenc, palette, TRUE, error))
     return FALSE;
@@ -84,118 +343,719 @@ byzanz_encoder_gif_quantize (ByzanzEncoderGif * gif,
   return TRUE;
 }
 
+/* Encoding an extra image costs about as much as this many pixels: the
+ * graphic control and image descriptor blocks, restarting LZW and another
+ * round trip through gifenc. */
+#define BYZANZ_ENCODER_GIF_SUBIMAGE_COST 2048
+
+static guint64
+byzanz_encoder_gif_area_cost (const cairo_rectangle_int_t *area)
+{
+  return (guint64) area->width * area->height + BYZANZ_ENCODER_GIF_SUBIMAGE_COST;
+}
+
+/* Merges the two of the n_areas areas where merging saves the most or, if
+ * force is set, costs the least. Returns FALSE if nothing was merged. */
 static gboolean
-byzanz_encoder_write_image (ByzanzEncoderGif *gif, guint64 msecs, GError **error)
+byzanz_encoder_gif_merge_areas (cairo_rectangle_int_t *areas,
+                                guint *                n_areas,
+                                gboolean               force)
 {
-  guint elapsed;
-  guint width;
+  cairo_rectangle_int_t merged;
+  gint64 cost, best_cost = G_MAXINT64;
+  guint i, j, best_i = 0, best_j = 0;
 
-  g_assert (gif->cached_data != NULL);
-  g_assert (gif->cached_area.width > 0);
-  g_assert (gif->cached_area.height > 0);
+  if (*n_areas < 2)
+    return FALSE;
 
-  width = gifenc_get_width (gif->gifenc);
-  elapsed = msecs - gif->cached_time;
-  elapsed = MAX (elapsed, 10);
+  for (i = 0; i < *n_areas; i++) {
+    for (j = i + 1; j < *n_areas; j++) {
+      gdk_rectangle_union ((const GdkRectangle *) &areas[i],
+          (const GdkRectangle *) &areas[j], (GdkRectangle *) &merged);
+      cost = byzanz_encoder_gif_area_cost (&merged)
+        - byzanz_encoder_gif_area_cost (&areas[i])
+        - byzanz_encoder_gif_area_cost (&areas[j]);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_i = i;
+        best_j = j;
+      }
+    }
+  }
 
-  if (!gifenc_add_image (gif->gifenc, gif->cached_area.x, gif->cached_area.y, 
-            gif->cached_area.width, gif->cached_area.height, elapsed,
-            gif->cached_data + width * gif->cached_area.y + gif->cached_area.x,
-            width, error))
+  if (!force && best_cost > 0)
     return FALSE;
 
-  gif->cached_time = msecs;
+  gdk_rectangle_union ((const GdkRectangle *) &areas[best_i],
+      (const GdkRectangle *) &areas[best_j], (GdkRectangle *) &areas[best_i]);
+  (*n_areas)--;
+  areas[best_j] = areas[*n_areas];
   return TRUE;
 }
 
+static void
+byzanz_encoder_gif_add_area (cairo_rectangle_int_t *       areas,
+                             guint *                       n_areas,
+                             const cairo_rectangle_int_t * area)
+{
+  if (*n_areas == BYZANZ_ENCODER_GIF_MAX_AREAS)
+    byzanz_encoder_gif_merge_areas (areas, n_areas, TRUE);
+  areas[(*n_areas)++] = *area;
+}
+
+/* Frames only hold memory for the bounding box of their changes, so a
+ * frame used for a full screen change once does not keep the memory for 
+ * the small changes after it. */
+static void
+byzanz_encoder_gif_frame_allocate (ByzanzEncoderGifFrame *       frame,
+                                   const cairo_rectangle_int_t * bounds)
+{
+  gsize size;
+
+  size = (gsize) bounds->width * bounds->height;
+  if (size > frame->size || size < frame->size / 4) {
+    g_free (frame->data);
+    g_free (frame->previous);
+    frame->data = g_malloc (size);
+    frame->previous = g_malloc (size);
+    frame->size = size;
+  }
+  frame->bounds = *bounds;
+}
+
+static void
+byzanz_encoder_gif_fill (ByzanzEncoderGifFrame *       frame,
+                         guint8 *                      data,
+                         const cairo_rectangle_int_t * rect,
+                         guint8                        value)
+{
+  guint y;
+
+  for (y = 0; y < (guint) rect->height; y++) {
+    memset (BYZANZ_ENCODER_GIF_FRAME_PIXEL (frame, data, rect->x, rect->y + y),
+        value, rect->width);
+  }
+}
+
+/* Only the areas of a frame are encoded, so only they need to be valid. 
+ * Sets the parts of them that nothing was dithered into to value. */
+static void
+byzanz_encoder_gif_fill_areas (ByzanzEncoderGifFrame * frame,
+                               guint8 *                data,
+                               const cairo_region_t *  dithered,
+                               guint8                  value)
+{
+  cairo_rectangle_int_t rect;
+  cairo_region_t *fill;
+  guint i, n_rects;
+
+  fill = cairo_region_create_rectangles (frame->areas, frame->n_areas);
+  cairo_region_subtract (fill, dithered);
+  n_rects = cairo_region_num_rectangles (fill);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (fill, i, &rect);
+    byzanz_encoder_gif_fill (frame, data, &rect, value);
+  }
+  cairo_region_destroy (fill);
+}
+
+/* dithers rect of source into the frame and remembers the source pixels */
+static void
+byzanz_encoder_gif_dither_rect (ByzanzEncoderGifDitherJob *   job,
+                                const guint8 *                source,
+                                const cairo_rectangle_int_t * rect)
+{
+  ByzanzEncoderGif *gif = job->gif;
+  cairo_rectangle_int_t area;
+  guint y, width;
+  gboolean changed;
+
+  width = gifenc_get_width (gif->gifenc);
+  if (job->method == GIFENC_DITHER_ORDERED)
+    changed = gifenc_dither_rgb_ordered_with_full_image_threaded (gif->gifenc,
+        job->context, BYZANZ_ENCODER_GIF_FRAME_PIXEL (job->frame, data, rect->x, rect->y),
+        job->frame->bounds.width,
+        gif->image_data + width * rect->y + rect->x, width, 
+        gif->gifenc->palette, source, rect->width, rect->height, job->stride, 
+        rect->x, rect->y, &area);
+  else
+    changed = gifenc_dither_rgb_with_full_image_threaded (gif->gifenc, job->context,
+        BYZANZ_ENCODER_GIF_FRAME_PIXEL (job->frame, data, rect->x, rect->y),
+        job->frame->bounds.width,
+        gif->image_data + width * rect->y + rect->x, width, 
+        gif->gifenc->palette, source, rect->width, rect->height, job->stride, &area);
+
+  for (y = 0; y < (guint) rect->height; y++) {
+    memcpy (gif->shadow + (width * (rect->y + y) + rect->x) * 4,
+        source + y * job->stride, rect->width * 4);
+  }
+
+  if (changed) {
+    area.x += rect->x;
+    area.y += rect->y;
+    byzanz_encoder_gif_add_area (job->areas, &job->n_areas, &area);
+  }
+}
+
+/* Damaged rectangles often contain pixels that were repainted unchanged.
+ * Only dither the bands of rows that changed from the last frame. Skipped
+ * pixels stay transparent. Error diffusion restarts at the top of every
+ * band, but carries along its rows, so bands are only trimmed to the
+ * columns that changed when dithering ordered. */
+static void
+byzanz_encoder_gif_dither_changes (ByzanzEncoderGifDitherJob *   job,
+                                   const guint8 *                source,
+                                   const cairo_rectangle_int_t * rect)
+{
+  cairo_rectangle_int_t band;
+  const guint32 *src, *shadow;
+  guint x, y, start, left, end, width, stride;
+  gboolean trim;
+
+#define SOURCE(y) ((const guint32 *) (source + (y) * stride))
+#define SHADOW(y) ((const guint32 *) job->gif->shadow + width * (rect->y + (y)) + rect->x)
+  width = gifenc_get_width (job->gif->gifenc);
+  stride = job->stride;
+  trim = job->method == GIFENC_DITHER_ORDERED;
+  y = 0;
+  while (y < (guint) rect->height) {
+    /* memcmp is vectorized, so rule out unchanged rows with it first */
+    if (memcmp (SOURCE (y), SHADOW (y), rect->width * 4) == 0) {
+      y++;
+      continue;
+    }
+    start = y;
+    left = trim ? rect->width : 0;
+    end = trim ? 0 : rect->width;
+    for (; y < (guint) rect->height; y++) {
+      src = SOURCE (y);
+      shadow = SHADOW (y);
+      if (memcmp (src, shadow, rect->width * 4) == 0)
+        break;
+      /* only look at the columns outside of what changed already */
+      for (x = 0; x < left && src[x] == shadow[x]; x++);
+      left = x;
+      for (x = rect->width; x > end && src[x - 1] == shadow[x - 1]; x--);
+      end = MAX (end, x);
+    }
+    band.x = rect->x + left;
+    band.y = rect->y + start;
+    band.width = end - left;
+    band.height = y - start;
+    byzanz_encoder_gif_dither_rect (job, source + start * stride + left * 4, &band);
+  }
+#undef SOURCE
+#undef SHADOW
+}
+
+static int
+byzanz_encoder_gif_dither_rect_compare (gconstpointer a,
+                                        gconstpointer b)
+{
+  const cairo_rectangle_int_t *ra = &((const ByzanzEncoderGifDitherRect *) a)->rect;
+  const cairo_rectangle_int_t *rb = &((const ByzanzEncoderGifDitherRect *) b)->rect;
+  guint64 pa = (guint64) ra->width * ra->height;
+  guint64 pb = (guint64) rb->width * rb->height;
+
+  return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+static void
+byzanz_encoder_gif_dither_job_run (ByzanzEncoderGifDitherJob *job)
+{
+  ByzanzEncoderGifDitherRect *r;
+  const guint8 *source;
+  guint i;
+
+  for (i = 0; i < job->gif->dither_rects->len; i++) {
+    r = &g_array_index (job->gif->dither_rects, ByzanzEncoderGifDitherRect, i);
+    if (r->job != job->id)
+      continue;
+    source = job->source + (r->rect.x - job->extents.x) * 4 
+        + (r->rect.y - job->extents.y) * job->stride;
+    if (r->known) {
+      /* unchanged pixels are skipped, so they need to be transparent */
+      byzanz_encoder_gif_fill (job->frame, job->frame->data, &r->rect,
+          gifenc_palette_get_alpha_index (job->gif->gifenc->palette));
+      byzanz_encoder_gif_dither_changes (job, source, &r->rect);
+    } else
+      byzanz_encoder_gif_dither_rect (job, source, &r->rect);
+  }
+}
+
+static void
+byzanz_encoder_gif_dither_thread (gpointer data, gpointer gif_ptr)
+{
+  ByzanzEncoderGif *gif = gif_ptr;
+
+  byzanz_encoder_gif_dither_job_run (data);
+
+  g_mutex_lock (&gif->dither_mutex);
+  gif->dither_pending--;
+  if (gif->dither_pending == 0)
+    g_cond_signal (&gif->dither_cond);
+  g_mutex_unlock (&gif->dither_mutex);
+}
+
+/* Returns the mean squared distance of the colors in region to the colors
+ * they get in the global palette. Only every few pixels are looked at. */
+#define BYZANZ_ENCODER_GIF_PALETTE_ERROR_SAMPLE 4
+static guint
+byzanz_encoder_gif_palette_error (ByzanzEncoderGif *     gif,
+                                  cairo_surface_t *      surface,
+                                  const cairo_region_t * region)
+{
+  const GifencPalette *palette = gif->gifenc->palette;
+  cairo_rectangle_int_t extents, rect;
+  const guint8 *data;
+  const guint32 *row;
+  guint32 color, looked_up;
+  guint64 error, n_pixels;
+  guint i, x, y, n_rects, stride;
+  gint r, g, b;
+
+  cairo_region_get_extents (region, &extents);
+  data = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+  error = 0;
+  n_pixels = 0;
+  n_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    for (y = 0; y < (guint) rect.height; y += BYZANZ_ENCODER_GIF_PALETTE_ERROR_SAMPLE) {
+      row = (const guint32 *) (data + (rect.y - extents.y + y) * stride) 
+          + rect.x - extents.x;
+      for (x = 0; x < (guint) rect.width; x += BYZANZ_ENCODER_GIF_PALETTE_ERROR_SAMPLE) {
+        color = row[x] & 0xFFFFFF;
+        palette->lookup (palette->data, color, &looked_up);
+        r = (gint) (color >> 16) - (gint) (looked_up >> 16 & 0xFF);
+        g = (gint) (color >> 8 & 0xFF) - (gint) (looked_up >> 8 & 0xFF);
+        b = (gint) (color & 0xFF) - (gint) (looked_up & 0xFF);
+        error += r * r + g * g + b * b;
+        n_pixels++;
+      }
+    }
+  }
+
+  return n_pixels ? error / n_pixels : 0;
+}
+
+/* Content that looks nothing like the first frame, like a photo opened
+ * after recording a terminal, gets noisy when dithered to the global
+ * palette. Such frames are better off with their own palette. */
+static gboolean
+byzanz_encoder_gif_needs_palette (ByzanzEncoderGif *     gif,
+                                  cairo_surface_t *      surface,
+                                  const cairo_region_t * region)
+{
+  cairo_rectangle_int_t rect;
+  guint i, n_rects;
+  guint64 pixels;
+
+  pixels = 0;
+  n_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    pixels += (guint64) rect.width * rect.height;
+  }
+  if (pixels < BYZANZ_ENCODER_GIF_LOCAL_PALETTE_PIXELS)
+    return FALSE;
+
+  return byzanz_encoder_gif_palette_error (gif, surface, region) > 
+      MAX (2 * gif->palette_error, BYZANZ_ENCODER_GIF_LOCAL_PALETTE_ERROR);
+}
+
+/* Quantizes region on its own and dithers it into the frame as a single 
+ * image with a local color table. Pixels that did not change from the 
+ * last frame stay transparent. */
+static void
+byzanz_encoder_gif_encode_local (ByzanzEncoderGif *            gif,
+                                 ByzanzEncoderGifFrame *       frame,
+                                 cairo_surface_t *             surface,
+                                 const cairo_region_t *        region,
+                                 const cairo_rectangle_int_t * extents)
+{
+  GifencHistogram *histogram;
+  cairo_rectangle_int_t rect;
+  const guint8 *data, *source;
+  guint32 *shadow;
+  guint8 *target, transparent, global_transparent;
+  guint i, x, y, n_rects, stride, width;
+  gboolean known;
+  GifencDitherMethod method;
+
+  data = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+  width = gifenc_get_width (gif->gifenc);
+  n_rects = cairo_region_num_rectangles (region);
+
+  histogram = gifenc_histogram_new ();
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    gifenc_histogram_add_image (histogram, 
+        data + (rect.y - extents->y) * stride + (rect.x - extents->x) * 4,
+        rect.width, rect.height, stride);
+  }
+  frame->palette = gifenc_quantize_histogram (histogram, 
+      gif->gifenc->quantizer, TRUE, 255, TRUE);
+  gifenc_histogram_free (histogram);
+  transparent = gifenc_palette_get_alpha_index (frame->palette);
+  global_transparent = gifenc_palette_get_alpha_index (gif->gifenc->palette);
+  method = g_atomic_int_get (&gif->dither_method);
+
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    source = data + (rect.y - extents->y) * stride + (rect.x - extents->x) * 4;
+    target = BYZANZ_ENCODER_GIF_FRAME_PIXEL (frame, data, rect.x, rect.y);
+    known = cairo_region_contains_rectangle (gif->shadow_region, &rect) == CAIRO_REGION_OVERLAP_IN;
+    if (!known)
+      cairo_region_union_rectangle (gif->shadow_region, &rect);
+
+    if (method == GIFENC_DITHER_ORDERED)
+      gifenc_dither_rgb_ordered_threaded (gif->gifenc, gif->dither_jobs[0].context,
+          target, frame->bounds.width, frame->palette, source, rect.width, rect.height, 
+          stride, rect.x, rect.y);
+    else
+      gifenc_dither_rgb_threaded (gif->gifenc, gif->dither_jobs[0].context,
+          target, frame->bounds.width, frame->palette, source, rect.width, rect.height, stride);
+    for (y = 0; y < (guint) rect.height; y++) {
+      shadow = (guint32 *) gif->shadow + width * (rect.y + y) + rect.x;
+      if (known) {
+        for (x = 0; x < (guint) rect.width; x++) {
+          if (((const guint32 *) (source + y * stride))[x] == shadow[x])
+            target[frame->bounds.width * y + x] = transparent;
+        }
+      }
+      memcpy (shadow, source + y * stride, rect.width * 4);
+      /* the global indexes shown here are gone, so later frames must write
+       * every one of these pixels that changes instead of matching it */
+      memset (gif->image_data + width * (rect.y + y) + rect.x, 
+          global_transparent, rect.width);
+    }
+  }
+
+  frame->areas[0] = *extents;
+  frame->n_areas = 1;
+  byzanz_encoder_gif_fill_areas (frame, frame->data, region, transparent);
+}
+
 static gboolean
 byzanz_encoder_gif_encode_image (ByzanzEncoderGif *      gif,
+                                 ByzanzEncoderGifFrame * frame,
                                  cairo_surface_t *       surface,
-                                 const cairo_region_t *  region,
-                                 cairo_rectangle_int_t * area_out)
+                                 const cairo_region_t *  region)
 {
-  cairo_rectangle_int_t extents, area, rect;
+  ByzanzEncoderGifDitherRect *r;
+  ByzanzEncoderGifDitherJob *job;
+  cairo_rectangle_int_t extents, *area;
+  GifencDitherMethod method;
   guint8 transparent;
-  guint i, n_rects, stride, width;
+  guint i, j, y, n_rects, n_jobs, stride, width, n_allocations;
+  guint64 pixels;
 
+  n_allocations = gifenc_dither_get_n_allocations ();
   cairo_region_get_extents (region, &extents);
+  byzanz_encoder_gif_frame_allocate (frame, &extents);
+  if (frame->palette) {
+    gifenc_palette_free (frame->palette);
+    frame->palette = NULL;
+  }
+  if (byzanz_encoder_gif_needs_palette (gif, surface, region)) {
+    byzanz_encoder_gif_encode_local (gif, frame, surface, region, &extents);
+    return TRUE;
+  }
   transparent = gifenc_palette_get_alpha_index (gif->gifenc->palette);
   stride = cairo_image_surface_get_stride (surface);
   width = gifenc_get_width (gif->gifenc);
+  method = g_atomic_int_get (&gif->dither_method);
 
-  /* clear area */
-  /* FIXME: only do this in parts not captured by region */
-  for (i = extents.y; i < (guint) (extents.y + extents.height); i++) {
-    memset (gif->cached_tmp + width * i + extents.x, transparent, extents.width);
+  /* the shadow is only valid where something was dithered before */
+  n_rects = cairo_region_num_rectangles (region);
+  g_array_set_size (gif->dither_rects, n_rects);
+  pixels = 0;
+  for (i = 0; i < n_rects; i++) {
+    r = &g_array_index (gif->dither_rects, ByzanzEncoderGifDitherRect, i);
+    cairo_region_get_rectangle (region, i, &r->rect);
+    r->known = cairo_region_contains_rectangle (gif->shadow_region, &r->rect) == CAIRO_REGION_OVERLAP_IN;
+    if (!r->known)
+      cairo_region_union_rectangle (gif->shadow_region, &r->rect);
+    pixels += (guint64) r->rect.width * r->rect.height;
   }
 
-  /* render changed parts */
-  n_rects = cairo_region_num_rectangles (region);
-  memset (area_out, 0, sizeof (cairo_rectangle_int_t));
+  n_jobs = MIN (gif->n_dither_jobs, n_rects);
+  n_jobs = MIN (n_jobs, pixels / BYZANZ_ENCODER_GIF_DITHER_JOB_PIXELS);
+  n_jobs = MAX (n_jobs, 1);
+  for (i = 0; i < n_jobs; i++) {
+    job = &gif->dither_jobs[i];
+    job->gif = gif;
+    job->frame = frame;
+    job->id = i;
+    job->method = method;
+    job->source = cairo_image_surface_get_data (surface);
+    job->stride = stride;
+    job->extents = extents;
+    job->pixels = 0;
+    job->n_areas = 0;
+  }
+
+  /* rects are disjoint, so they can be dithered in parallel. Hand them out 
+   * largest first to the job with the fewest pixels so far. */
+  g_array_sort (gif->dither_rects, byzanz_encoder_gif_dither_rect_compare);
   for (i = 0; i < n_rects; i++) {
-    cairo_region_get_rectangle (region, i, &rect);
-    if (gifenc_dither_rgb_with_full_image (
-          gif->cached_tmp + width * rect.y + rect.x, width,
-	  gif->image_data + width * rect.y + rect.x, width, 
-	  gif->gifenc->palette, 
-          cairo_image_surface_get_data (surface) + (rect.x - extents.x) * 4
-              + (rect.y - extents.y) * stride,
-          rect.width, rect.height, stride, &area)) {
-      area.x += rect.x;
-      area.y += rect.y;
-      if (area_out->width > 0 && area_out->height > 0)
-        gdk_rectangle_union ((const GdkRectangle*)area_out, (const GdkRectangle*) &area, (GdkRectangle*)area_out);
-      else
-        *area_out = area;
+    r = &g_array_index (gif->dither_rects, ByzanzEncoderGifDitherRect, i);
+    r->job = 0;
+    for (j = 1; j < n_jobs; j++) {
+      if (gif->dither_jobs[j].pixels < gif->dither_jobs[r->job].pixels)
+        r->job = j;
+    }
+    gif->dither_jobs[r->job].pixels += (guint64) r->rect.width * r->rect.height;
+  }
+
+  gif->dither_pending = n_jobs - 1;
+  for (i = 1; i < n_jobs; i++) {
+    g_thread_pool_push (gif->dither_pool, &gif->dither_jobs[i], NULL);
+  }
+  byzanz_encoder_gif_dither_job_run (&gif->dither_jobs[0]);
+  g_mutex_lock (&gif->dither_mutex);
+  while (gif->dither_pending > 0)
+    g_cond_wait (&gif->dither_cond, &gif->dither_mutex);
+  g_mutex_unlock (&gif->dither_mutex);
+  /* the dither contexts are big enough for every frame, so this only 
+   * triggers in builds with --enable-debug when they are not used */
+  g_warn_if_fail (gifenc_dither_get_n_allocations () == n_allocations);
+
+  /* only keep separate images for clusters that are far enough apart */
+  frame->n_areas = 0;
+  for (i = 0; i < n_jobs; i++) {
+    job = &gif->dither_jobs[i];
+    for (j = 0; j < job->n_areas; j++) {
+      byzanz_encoder_gif_add_area (frame->areas, &frame->n_areas, &job->areas[j]);
     }
   }
+  while (byzanz_encoder_gif_merge_areas (frame->areas, &frame->n_areas, FALSE));
 
-  return area_out->width > 0 && area_out->height > 0;
+  byzanz_encoder_gif_fill_areas (frame, frame->data, region, transparent);
+  /* image_data is changed by the next frames while this one is written */
+  for (i = 0; i < frame->n_areas; i++) {
+    area = &frame->areas[i];
+    for (y = 0; y < (guint) area->height; y++) {
+      memcpy (BYZANZ_ENCODER_GIF_FRAME_PIXEL (frame, previous, area->x, area->y + y), 
+          gif->image_data + width * (area->y + y) + area->x, area->width);
+    }
+  }
+
+  return frame->n_areas > 0;
 }
 
-static void
-byzanz_encoder_swap_image (ByzanzEncoderGif *      gif,
-                           cairo_rectangle_int_t * area)
+/* the cached frame is complete once we know how long to display it */
+static gboolean
+byzanz_encoder_gif_finish_cached (ByzanzEncoderGif *gif,
+                                  guint64           msecs,
+                                  GError **         error)
 {
-  guint8 *swap;
+  ByzanzEncoderGifFrame *frame = gif->cached;
+  cairo_region_t *valid;
+  guint elapsed;
+  guint8 transparent;
+
+  g_assert (frame != NULL);
+
+  elapsed = msecs - frame->time;
+  frame->duration = MAX (elapsed, 10);
+  gif->cached = NULL;
+
+  /* Browsers show images with very short delays for 100ms, so every image
+   * but the last one needs BYZANZ_ENCODER_GIF_SUBIMAGE_DELAY. Merge images
+   * until the frame's duration covers that. */
+  if (frame->duration < BYZANZ_ENCODER_GIF_SUBIMAGE_DELAY * (frame->n_areas - 1)) {
+    valid = cairo_region_create_rectangles (frame->areas, frame->n_areas);
+    while (frame->duration < BYZANZ_ENCODER_GIF_SUBIMAGE_DELAY * (frame->n_areas - 1))
+      byzanz_encoder_gif_merge_areas (frame->areas, &frame->n_areas, TRUE);
+    /* image_data has moved on already, so the pixels the areas grew by 
+     * are left transparent in the frame and below it */
+    transparent = gifenc_palette_get_alpha_index (gif->gifenc->palette);
+    byzanz_encoder_gif_fill_areas (frame, frame->data, valid, 
+        frame->palette ? gifenc_palette_get_alpha_index (frame->palette) : transparent);
+    byzanz_encoder_gif_fill_areas (frame, frame->previous, valid, transparent);
+    cairo_region_destroy (valid);
+  }
 
-  swap = gif->cached_data;
-  gif->cached_data = gif->cached_tmp;
-  gif->cached_tmp = swap;
-  gif->cached_area = *area;
+  return byzanz_encoder_gif_submit_frame (gif, frame, error);
 }
 
 static gboolean
-byzanz_encoder_gif_process (ByzanzEncoder *        encoder,
-                            GOutputStream *        stream,
-                            guint64                msecs,
-                            cairo_surface_t *      surface,
-                            const cairo_region_t * region,
-                            GCancellable *         cancellable,
-                            GError **	           error)
+byzanz_encoder_gif_encode_frame (ByzanzEncoderGif *     gif,
+                                 guint64                msecs,
+                                 cairo_surface_t *      surface,
+                                 const cairo_region_t * region,
+                                 GError **              error)
 {
-  ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (encoder);
-  cairo_rectangle_int_t area;
+  ByzanzEncoderGifFrame *frame;
 
   if (!gif->has_quantized) {
     if (!byzanz_encoder_gif_quantize (gif, surface, error))
       return FALSE;
-    gif->cached_time = msecs;
-    if (!byzanz_encoder_gif_encode_image (gif, surface, region, &area)) {
+    gif->palette_error = byzanz_encoder_gif_palette_error (gif, surface, region);
+    if (gif->pipelined)
+      byzanz_encoder_gif_start_writer (gif);
+    frame = g_async_queue_pop (gif->free_frames);
+    if (!byzanz_encoder_gif_encode_image (gif, frame, surface, region)) {
       g_assert_not_reached ();
     }
-    byzanz_encoder_swap_image (gif, &area);
   } else {
-    if (byzanz_encoder_gif_encode_image (gif, surface, region, &area)) {
-      if (!byzanz_encoder_write_image (gif, msecs, error))
-        return FALSE;
-      byzanz_encoder_swap_image (gif, &area);
+    /* blocks while the writer is busy with all other frames */
+    frame = g_async_queue_pop (gif->free_frames);
+    if (!byzanz_encoder_gif_encode_image (gif, frame, surface, region)) {
+      g_async_queue_push (gif->free_frames, frame);
+      return TRUE;
     }
+    if (!byzanz_encoder_gif_finish_cached (gif, msecs, error)) {
+      g_async_queue_push (gif->free_frames, frame);
+      return FALSE;
+    }
+  }
+
+  frame->time = msecs;
+  gif->cached = frame;
+  return TRUE;
+}
+
+/*** TWO PASS ENCODING ***/
+
+/* A palette for all frames keeps the same colors at the same indexes 
+ * throughout the recording, which makes changes smaller than a palette 
+ * that only fits the first frame. The first pass counts the colors of 
+ * every frame, the second pass reads the frames again and encodes them. */
+
+static void
+byzanz_encoder_gif_drop_spill (ByzanzEncoderGif *gif)
+{
+  if (gif->spill) {
+    g_object_unref (gif->spill);
+    gif->spill = NULL;
+  }
+  if (gif->spill_file) {
+    g_file_delete (gif->spill_file, NULL, NULL);
+    g_object_unref (gif->spill_file);
+    gif->spill_file = NULL;
+  }
+}
+
+static gboolean
+byzanz_encoder_gif_start_first_pass (ByzanzEncoderGif *gif,
+                                     GError **         error)
+{
+  /* inputs that can't be read twice are copied to a temporary file */
+  if (gif->input_offset < 0) {
+    gif->spill_file = g_file_new_tmp ("byzanzgifXXXXXX", &gif->spill, error);
+    if (gif->spill_file == NULL)
+      return FALSE;
   }
 
+  gif->histogram = gifenc_histogram_new ();
+  gif->first_pass = TRUE;
   return TRUE;
 }
 
+static gboolean
+byzanz_encoder_gif_count_frame (ByzanzEncoderGif *     gif,
+                                guint64                msecs,
+                                cairo_surface_t *      surface,
+                                const cairo_region_t * region,
+                                GCancellable *         cancellable,
+                                GError **              error)
+{
+  cairo_rectangle_int_t extents, rect;
+  const guint8 *data;
+  guint i, n_rects, stride;
+
+  cairo_region_get_extents (region, &extents);
+  data = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+  n_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    gifenc_histogram_add_image (gif->histogram, 
+        data + (rect.y - extents.y) * stride + (rect.x - extents.x) * 4,
+        rect.width, rect.height, stride);
+  }
+
+  if (gif->spill == NULL)
+    return TRUE;
+
+  return byzanz_serialize (g_io_stream_get_output_stream (G_IO_STREAM (gif->spill)),
+      msecs, surface, region, cancellable, error);
+}
+
+static gboolean
+byzanz_encoder_gif_second_pass (ByzanzEncoderGif * gif,
+                                guint64            msecs,
+                                GCancellable *     cancellable,
+                                GError **          error)
+{
+  GInputStream *input;
+  GOutputStream *output;
+  cairo_surface_t *surface;
+  cairo_region_t *region;
+  guint64 frame_msecs;
+  gboolean success;
+
+  gif->first_pass = FALSE;
+  if (gif->spill) {
+    output = g_io_stream_get_output_stream (G_IO_STREAM (gif->spill));
+    if (!byzanz_serialize (output, msecs, NULL, NULL, cancellable, error) ||
+        !g_output_stream_flush (output, cancellable, error) ||
+        !g_seekable_seek (G_SEEKABLE (gif->spill), 0, G_SEEK_SET, cancellable, error))
+      return FALSE;
+    input = g_io_stream_get_input_stream (G_IO_STREAM (gif->spill));
+  } else {
+    input = BYZANZ_ENCODER (gif)->input_stream;
+    if (!g_seekable_seek (G_SEEKABLE (input), gif->input_offset, G_SEEK_SET,
+            cancellable, error))
+      return FALSE;
+  }
+
+  for (;;) {
+    if (!byzanz_deserialize (input, &frame_msecs, &surface, &region, cancellable, error))
+      return FALSE;
+    if (surface == NULL)
+      break;
+
+    success = byzanz_encoder_gif_encode_frame (gif, frame_msecs, surface, region, error);
+    cairo_surface_destroy (surface);
+    cairo_region_destroy (region);
+    if (!success)
+      return FALSE;
+  }
+
+  byzanz_encoder_gif_drop_spill (gif);
+  return TRUE;
+}
+
+static gboolean
+byzanz_encoder_gif_process (ByzanzEncoder *        encoder,
+                            GOutputStream *        stream,
+                            guint64                msecs,
+                            cairo_surface_t *      surface,
+                            const cairo_region_t * region,
+                            GCancellable *         cancellable,
+                            GError **	           error)
+{
+  ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (encoder);
+
+  /* files are always encoded in two passes, live recordings on request */
+  if (!gif->has_quantized && gif->histogram == NULL &&
+      (gif->input_offset >= 0 || g_atomic_int_get (&gif->two_pass)) &&
+      !byzanz_encoder_gif_start_first_pass (gif, error))
+    return FALSE;
+
+  if (gif->first_pass)
+    return byzanz_encoder_gif_count_frame (gif, msecs, surface, region, 
+        cancellable, error);
+
+  return byzanz_encoder_gif_encode_frame (gif, msecs, surface, region, error);
+}
+
 static gboolean
 byzanz_encoder_gif_close (ByzanzEncoder *  encoder,
                           GOutputStream *  stream,
@@ -205,12 +1065,20 @@ byzanz_encoder_gif_close (ByzanzEncoder *  encoder,
 {
   ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (encoder);
 
+  if (gif->first_pass &&
+      !byzanz_encoder_gif_second_pass (gif, msecs, cancellable, error))
+    return FALSE;
+
   if (!gif->has_quantized) {
     g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, _("No image to encode."));
     return FALSE;
   }
 
-  if (!byzanz_encoder_write_image (gif, msecs, error) ||
+  if (!byzanz_encoder_gif_finish_cached (gif, msecs, error))
+    return FALSE;
+
+  byzanz_encoder_gif_stop_writer (gif);
+  if (!byzanz_encoder_gif_check_writer (gif, error) ||
       !gifenc_close (gif->gifenc, error))
     return FALSE;
 
@@ -221,28 +1089,120 @@ static void
 byzanz_encoder_gif_finalize (GObject *object)
 {
   ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (object);
+  guint i;
+
+  /* in case encoding was aborted */
+  byzanz_encoder_gif_stop_writer (gif);
+  if (gif->encode_frames)
+    g_async_queue_unref (gif->encode_frames);
+  if (gif->free_frames)
+    g_async_queue_unref (gif->free_frames);
+  if (gif->writer_error)
+    g_error_free (gif->writer_error);
+
+  if (gif->dither_pool)
+    g_thread_pool_free (gif->dither_pool, FALSE, TRUE);
+  if (gif->dither_rects)
+    g_array_free (gif->dither_rects, TRUE);
+  for (i = 0; i < gif->n_dither_jobs; i++) {
+    gifenc_dither_context_free (gif->dither_jobs[i].context);
+  }
+  g_mutex_clear (&gif->dither_mutex);
+  g_cond_clear (&gif->dither_cond);
 
   g_free (gif->image_data);
-  g_free (gif->cached_data);
-  g_free (gif->cached_tmp);
+  g_free (gif->shadow);
+  if (gif->shadow_region)
+    cairo_region_destroy (gif->shadow_region);
+  for (i = 0; i < gif->n_frames; i++) {
+    g_free (gif->frames[i].data);
+    g_free (gif->frames[i].previous);
+    if (gif->frames[i].palette)
+      gifenc_palette_free (gif->frames[i].palette);
+  }
+  if (gif->histogram)
+    gifenc_histogram_free (gif->histogram);
+  byzanz_encoder_gif_drop_spill (gif);
   if (gif->gifenc)
     gifenc_free (gif->gifenc);
 
   G_OBJECT_CLASS (byzanz_encoder_gif_parent_class)->finalize (object);
 }
 
+static void
+byzanz_encoder_gif_get_property (GObject *object, guint param_id, GValue *value, 
+    GParamSpec * pspec)
+{
+  ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (object);
+
+  switch (param_id) {
+    case PROP_COMPRESSION_LEVEL:
+      g_value_set_uint (value, g_atomic_int_get (&gif->compression_level));
+      break;
+    case PROP_DITHER_METHOD:
+      g_value_set_enum (value, g_atomic_int_get (&gif->dither_method));
+      break;
+    case PROP_TWO_PASS:
+      g_value_set_boolean (value, g_atomic_int_get (&gif->two_pass));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+      break;
+  }
+}
+
+static void
+byzanz_encoder_gif_set_property (GObject *object, guint param_id, const GValue *value, 
+    GParamSpec * pspec)
+{
+  ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (object);
+
+  switch (param_id) {
+    case PROP_COMPRESSION_LEVEL:
+      /* the writer picks it up with the next frame */
+      g_atomic_int_set (&gif->compression_level, g_value_get_uint (value));
+      break;
+    case PROP_DITHER_METHOD:
+      /* the encoder picks it up with the next frame */
+      g_atomic_int_set (&gif->dither_method, g_value_get_enum (value));
+      break;
+    case PROP_TWO_PASS:
+      /* only has an effect before the first frame */
+      g_atomic_int_set (&gif->two_pass, g_value_get_boolean (value));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+      break;
+  }
+}
+
 static void
 byzanz_encoder_gif_class_init (ByzanzEncoderGifClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
   ByzanzEncoderClass *encoder_class = BYZANZ_ENCODER_CLASS (klass);
 
+  object_class->get_property = byzanz_encoder_gif_get_property;
+  object_class->set_property = byzanz_encoder_gif_set_property;
   object_class->finalize = byzanz_encoder_gif_finalize;
 
   encoder_class->setup = byzanz_encoder_gif_setup;
   encoder_class->process = byzanz_encoder_gif_process;
   encoder_class->close = byzanz_encoder_gif_close;
 
+  g_object_class_install_property (object_class, PROP_COMPRESSION_LEVEL,
+      g_param_spec_uint ("compression-level", "compression level", 
+          "color error allowed to make images smaller, 0 for lossless images",
+	  0, BYZANZ_ENCODER_GIF_MAX_COMPRESSION_LEVEL, 0, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_DITHER_METHOD,
+      g_param_spec_enum ("dither-method", "dither method", 
+          "method used to map colors to the palette",
+	  BYZANZ_TYPE_DITHER_METHOD, GIFENC_DITHER_FLOYD_STEINBERG, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, PROP_TWO_PASS,
+      g_param_spec_boolean ("two-pass", "two pass", 
+          "count the colors of all frames before encoding, inputs that can be read twice always are",
+	  FALSE, G_PARAM_READWRITE));
+
   encoder_class->filter = gtk_file_filter_new ();
   g_object_ref_sink (encoder_class->filter);
   gtk_file_filter_set_name (encoder_class->filter, _("GIF images"));
@@ -253,5 +1213,7 @@ byzanz_encoder_gif_class_init (ByzanzEncoderGifClass *klass)
 static void
 byzanz_encoder_gif_init (ByzanzEncoderGif *encoder_gif)
 {
+  g_mutex_init (&encoder_gif->dither_mutex);
+  g_cond_init (&encoder_gif->dither_cond);
 }
 
@@ -31,8 +31,67 @@ typedef struct _ByzanzEncoderGifClass ByzanzEncoderGifClass;
 #define BYZANZ_IS_ENCODER_GIF_CLASS(klass)         (G_TYPE_CHECK_CLASS_TYPE ((klass), BYZANZ_TYPE_ENCODER_GIF))
 #define BYZANZ_ENCODER_GIF(obj)                    (G_TYPE_CHECK_INSTANCE_CAST ((obj), BYZANZ_TYPE_ENCODER_GIF, ByzanzEncoderGif))
 #define BYZANZ_ENCODER_GIF_CLASS(klass)            (G_TYPE_CHECK_CLASS_CAST ((klass), BYZANZ_TYPE_ENCODER_GIF, ByzanzEncoderGifClass))
+#define BYZANZ_TYPE_DITHER_METHOD                  (byzanz_dither_method_get_type())
 #define BYZANZ_ENCODER_GIF_GET_CLASS(obj)          (G_TYPE_INSTANCE_GET_CLASS ((obj), BYZANZ_TYPE_ENCODER_GIF, ByzanzEncoderGifClass))
 
+/* maximum value of the compression-level property */
+#define BYZANZ_ENCODER_GIF_MAX_COMPRESSION_LEVEL 100
+
+/* frames in flight when pipelining */
+#define BYZANZ_ENCODER_GIF_MAX_FRAMES 4
+
+/* maximum number of images a frame is split into */
+#define BYZANZ_ENCODER_GIF_MAX_AREAS 16
+/* milliseconds every image but the last one of a frame is shown */
+#define BYZANZ_ENCODER_GIF_SUBIMAGE_DELAY 20
+
+/* maximum number of threads dithering a frame */
+#define BYZANZ_ENCODER_GIF_MAX_DITHER_JOBS 16
+/* frames are only split into jobs of at least this many pixels */
+#define BYZANZ_ENCODER_GIF_DITHER_JOB_PIXELS (1 << 15)
+
+/* frames need to change this many pixels to be worth a local color table */
+#define BYZANZ_ENCODER_GIF_LOCAL_PALETTE_PIXELS (1 << 16)
+/* mean squared color distance to the global palette that always gets a 
+ * frame its own palette, unless the first frame was that bad already */
+#define BYZANZ_ENCODER_GIF_LOCAL_PALETTE_ERROR 192
+
+typedef struct _ByzanzEncoderGifFrame ByzanzEncoderGifFrame;
+typedef struct _ByzanzEncoderGifDitherRect ByzanzEncoderGifDitherRect;
+typedef struct _ByzanzEncoderGifDitherJob ByzanzEncoderGifDitherJob;
+
+struct _ByzanzEncoderGifFrame {
+  cairo_rectangle_int_t bounds;         /* part of the image covered by data and previous */
+  guint8 *              data;           /* bounds sized image, only areas are relevant */
+  guint8 *              previous;       /* copy of image_data for the areas, shown below transparent pixels */
+  gsize                 size;           /* bytes allocated for data and previous each */
+  GifencPalette *       palette;        /* local color table of data or NULL for the global one */
+  cairo_rectangle_int_t areas[BYZANZ_ENCODER_GIF_MAX_AREAS]; /* disjoint changed areas, encoded as one image each */
+  guint                 n_areas;        /* number of areas */
+  guint64               time;           /* timestamp the frame corresponds to */
+  guint                 duration;       /* milliseconds to display the frame */
+};
+
+struct _ByzanzEncoderGifDitherRect {
+  cairo_rectangle_int_t rect;           /* damaged rectangle */
+  gboolean              known;          /* TRUE if the shadow is valid for rect */
+  guint                 job;            /* id of the job dithering rect */
+};
+
+struct _ByzanzEncoderGifDitherJob {
+  ByzanzEncoderGif *    gif;            /* encoder the job belongs to */
+  GifencDitherContext * context;        /* scratch memory, kept for all frames */
+  ByzanzEncoderGifFrame *frame;         /* frame to dither into */
+  guint                 id;             /* index of the job, rects with this job are dithered */
+  GifencDitherMethod    method;         /* dither method for the frame */
+  const guint8 *        source;         /* source pixels at the top left of the extents */
+  guint                 stride;         /* rowstride of source */
+  cairo_rectangle_int_t extents;        /* extents of the changed region */
+  guint64               pixels;         /* pixels in the rects of this job */
+  cairo_rectangle_int_t areas[BYZANZ_ENCODER_GIF_MAX_AREAS]; /* areas changed by this job */
+  guint                 n_areas;        /* number of areas */
+};
+
 struct _ByzanzEncoderGif {
   ByzanzEncoder         encoder;
 
@@ -40,12 +99,37 @@ struct _ByzanzEncoderGif {
 
   gboolean              has_quantized;  /* qantization has happened already */
   guint8 *              image_data;     /* width * height of encoded image */
+  guint8 *              shadow;         /* width * height source pixels of image_data */
+  cairo_region_t *      shadow_region;  /* area where shadow is valid */
+  guint                 palette_error;  /* color error of the first frame with the global palette */
+
+  gint                  two_pass;       /* gboolean: quantize all frames before encoding, accessed atomically */
+  gboolean              first_pass;     /* TRUE while frames are only counted into histogram */
+  GifencHistogram *     histogram;      /* colors of all frames for two pass encoding or NULL */
+  goffset               input_offset;   /* offset of the first frame in a seekable input or -1 */
+  GFile *               spill_file;     /* temporary file holding the frames of the first pass or NULL */
+  GFileIOStream *       spill;          /* stream for spill_file */
+
+  GThreadPool *         dither_pool;    /* threads helping to dither or NULL */
+  guint                 n_dither_jobs;  /* maximum number of jobs a frame is split into */
+  ByzanzEncoderGifDitherJob dither_jobs[BYZANZ_ENCODER_GIF_MAX_DITHER_JOBS]; /* jobs of current frame */
+  GArray *              dither_rects;   /* ByzanzEncoderGifDitherRect of current frame */
+  GMutex                dither_mutex;   /* protects dither_pending */
+  GCond                 dither_cond;    /* signalled when dither_pending reaches 0 */
+  guint                 dither_pending; /* jobs still running in dither_pool */
+
+  ByzanzEncoderGifFrame frames[BYZANZ_ENCODER_GIF_MAX_FRAMES]; /* ring of frames */
+  guint                 n_frames;       /* number of frames in use */
+  GAsyncQueue *         free_frames;    /* frames that can be dithered into */
+  ByzanzEncoderGifFrame *cached;        /* frame waiting for the next frame to know its duration */
 
-  cairo_rectangle_int_t cached_area;    /* area that is saved in cached_data */
-  guint8 *              cached_data;    /* cached_area.{width x height} sized area of image */
-  guint64               cached_time;    /* timestamp the cached image corresponds to */
+  gboolean              pipelined;      /* TRUE to do LZW encoding in a separate thread */
+  GThread *             writer;         /* thread doing LZW encoding or NULL */
+  GAsyncQueue *         encode_frames;  /* frames for the writer thread */
+  GError *              writer_error;   /* error that happened in the writer or NULL */
 
-  guint8 *		cached_tmp;	/* temporary data to swap cached_data with */
+  gint                  compression_level; /* color error allowed for lossy LZW, accessed atomically */
+  gint                  dither_method;  /* GifencDitherMethod, accessed atomically */
 };
 
 struct _ByzanzEncoderGifClass {
@@ -53,6 +137,7 @@ struct _ByzanzEncoderGifClass {
 };
 
 GType		byzanz_encoder_gif_get_type		(void) G_GNUC_CONST;
+GType		byzanz_dither_method_get_type		(void) G_GNUC_CONST;
 
 
 #endif /* __HAVE_BYZANZ_ENCODER_GIF_H__ */
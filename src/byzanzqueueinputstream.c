@@ -255,3 +255,24 @@ byzanz_queue_input_stream_new (ByzanzQueue *queue)
   return G_INPUT_STREAM (stream);
 }
 
+/* Returns the number of bytes that were written to the queue but not read 
+ * yet. The file that is currently written to is not counted, so this errs 
+ * on the low side. */
+goffset
+byzanz_queue_input_stream_get_backlog (ByzanzQueueInputStream *stream)
+{
+  goffset backlog;
+  gint n_files;
+
+  g_return_val_if_fail (BYZANZ_IS_QUEUE_INPUT_STREAM (stream), 0);
+
+  n_files = g_async_queue_length (stream->queue->files);
+  if (n_files <= 0)
+    return 0;
+
+  backlog = (goffset) (n_files - 1) * BYZANZ_QUEUE_FILE_SIZE;
+  if (stream->input)
+    backlog += BYZANZ_QUEUE_FILE_SIZE - MIN (stream->input_bytes, BYZANZ_QUEUE_FILE_SIZE);
+
+  return backlog;
+}
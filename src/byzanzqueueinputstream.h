@@ -47,6 +47,7 @@ struct _ByzanzQueueInputStreamClass {
 GType		byzanz_queue_input_stream_get_type		(void) G_GNUC_CONST;
 
 GInputStream *	byzanz_queue_input_stream_new			(ByzanzQueue *	queue);
+goffset		byzanz_queue_input_stream_get_backlog		(ByzanzQueueInputStream *stream);
 
 
 #endif /* __HAVE_BYZANZ_QUEUE_INPUT_STREAM_H__ */
@@ -408,3 +408,19 @@ byzanz_session_get_error (ByzanzSession *session)
   return session->error;
 }
 
+/**
+ * byzanz_session_get_encoder:
+ * @session: a session
+ *
+ * Gets the encoder used by @session, so encoder specific properties can be
+ * set before the recording starts.
+ *
+ * Returns: the encoder or %NULL if creating the output file failed
+ **/
+ByzanzEncoder *
+byzanz_session_get_encoder (ByzanzSession *session)
+{
+  g_return_val_if_fail (BYZANZ_IS_SESSION (session), NULL);
+  
+  return session->encoder;
+}
@@ -77,6 +77,7 @@ void			byzanz_session_abort            (ByzanzSession *	session);
 gboolean                byzanz_session_is_recording     (ByzanzSession *        session);
 gboolean                byzanz_session_is_encoding      (ByzanzSession *        session);
 const GError *          byzanz_session_get_error        (ByzanzSession *        session);
+ByzanzEncoder *         byzanz_session_get_encoder      (ByzanzSession *        session);
 					
 
 #endif /* __HAVE_BYZANZ_SESSION_H__ */
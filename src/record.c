@@ -30,6 +30,9 @@ static int delay = 1;
 static gboolean cursor = FALSE;
 static gboolean audio = FALSE;
 static gboolean verbose = FALSE;
+static int compression_level = 0;
+static char *dither = NULL;
+static gboolean two_pass = FALSE;
 static cairo_rectangle_int_t area = { 0, 0, G_MAXINT / 2, G_MAXINT / 2 };
 
 static GOptionEntry entries[] = 
@@ -42,6 +45,9 @@ static GOptionEntry entries[] =
   { "y", 'y', 0, G_OPTION_ARG_INT, &area.y, N_("Y coordinate of rectangle to record"), N_("PIXEL") },
   { "width", 'w', 0, G_OPTION_ARG_INT, &area.width, N_("Width of recording rectangle"), N_("PIXEL") },
   { "height", 'h', 0, G_OPTION_ARG_INT, &area.height, N_("Height of recording rectangle"), N_("PIXEL") },
+  { "compression-level", 0, 0, G_OPTION_ARG_INT, &compression_level, N_("Allow color errors up to LEVEL to make GIF images smaller (default: 0, lossless)"), N_("LEVEL") },
+  { "dither", 0, 0, G_OPTION_ARG_STRING, &dither, N_("Dithering for GIF images: floyd-steinberg (default) or ordered"), N_("METHOD") },
+  { "two-pass", 0, 0, G_OPTION_ARG_NONE, &two_pass, N_("Only encode GIF images once recording is done, with colors of all frames"), NULL },
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, N_("Be verbose"), NULL },
   { NULL }
 };
@@ -104,6 +110,21 @@ start_recording (gpointer session)
   return FALSE;
 }
 
+/* returns NULL if the output format does not support the property */
+static GParamSpec *
+find_encoder_property (ByzanzSession *session, const char *name)
+{
+  ByzanzEncoder *encoder = byzanz_session_get_encoder (session);
+  GParamSpec *pspec = NULL;
+
+  if (encoder)
+    pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (encoder), name);
+  if (pspec == NULL)
+    g_print (_("Ignoring %s, the file type does not support it.\n"), name);
+
+  return pspec;
+}
+
 static gboolean
 clamp_to_window (cairo_rectangle_int_t *out, GdkWindow *window, cairo_rectangle_int_t *in)
 {
@@ -155,6 +176,26 @@ main (int argc, char **argv)
   rec = byzanz_session_new (file, byzanz_encoder_get_type_from_file (file),
       gdk_get_default_root_window (), &area, cursor, audio);
   g_object_unref (file);
+  if (compression_level > 0) {
+    GParamSpec *pspec = find_encoder_property (rec, "compression-level");
+
+    if (pspec)
+      g_object_set (byzanz_session_get_encoder (rec), "compression-level",
+          MIN ((guint) compression_level, G_PARAM_SPEC_UINT (pspec)->maximum), NULL);
+  }
+  if (dither) {
+    GParamSpec *pspec = find_encoder_property (rec, "dither-method");
+    GEnumValue *value = NULL;
+
+    if (pspec)
+      value = g_enum_get_value_by_nick (G_PARAM_SPEC_ENUM (pspec)->enum_class, dither);
+    if (value)
+      g_object_set (byzanz_session_get_encoder (rec), "dither-method", value->value, NULL);
+    else if (pspec)
+      g_print (_("Unknown dithering method \"%s\".\n"), dither);
+  }
+  if (two_pass && find_encoder_property (rec, "two-pass"))
+    g_object_set (byzanz_session_get_encoder (rec), "two-pass", TRUE, NULL);
   g_signal_connect (rec, "notify", G_CALLBACK (session_notify_cb), NULL);
   delay = MAX (delay, 1);
   delay = (delay - 1) * 1000;